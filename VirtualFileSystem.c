@@ -2,28 +2,270 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fnmatch.h>
 
-#define BLOCK_SIZE 512
+#define DEFAULT_BLOCK_SIZE 512
+#define MIN_BLOCK_SIZE     512
+#define MAX_BLOCK_SIZE     65536
 #define MAX_NAME   50
 
-// Flattened virtual disk
+// Block addresses and counts are 64-bit so large disks don't overflow
+typedef uint64_t blk_t;
+
+// Flattened virtual disk (data region of the image)
 unsigned char *diskMemory = NULL;
-int TOTAL_BLOCKS = 1024;
+uint64_t TOTAL_BLOCKS = 1024;
+uint32_t blockSize = DEFAULT_BLOCK_SIZE;   // fixed when the image is formatted
+
+/* On-disk image layout, each region page aligned:
+ *   superblock | inode table | attribute table | share table |
+ *   allocation bitmap | data blocks
+ * The whole image is mmap'd; without an image file the same layout
+ * lives in an anonymous mapping. */
+#define IMAGE_MAGIC    "KVFSIMG1"
+#define IMAGE_VERSION  2
+#define IMAGE_ALIGN    4096
+#define NO_INODE       0xFFFFFFFFu
+#define NO_BLOCK       UINT64_MAX
+#define INLINE_EXTENTS 4
+#define MAX_INODES     (1u << 22)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t blockSize;
+    uint64_t totalBlocks;
+    uint64_t freeBlocks;
+    uint32_t inodeCount;
+    uint32_t freeInodes;
+    uint32_t inodeHint;
+    uint32_t features;
+    uint64_t inodeOff;
+    uint64_t bitmapOff;
+    uint64_t dataOff;
+    uint64_t imageSize;
+    uint64_t refOff;           // block share counts (FEATURE_DEDUP)
+    uint64_t sharedRefs;
+    uint64_t attrOff;          // inode attributes (FEATURE_ATTRS)
+} SuperBlock;
+
+#define FEATURE_DEDUP   1
+#define FEATURE_SHARING 2      // share table only (cp, snapshot); implied by DEDUP
+#define FEATURE_DIR_TOTALS 4   // directory inodes hold subtree totals
+#define FEATURE_ATTRS   8      // attribute table (mtime, xattrs) after the inodes
+
+typedef struct {
+    blk_t start;
+    uint64_t len;
+} DiskExtent;
+
+#define INODE_USED       1
+#define INODE_DIR        2
+#define INODE_COMPRESSED 4     // data stored as packed groups
+#define INODE_INLINE     8     // data held in ext[] itself (see Inline files)
+
+// A directory's contentBytes/blockCount are the totals of every file
+// below it (kept up to date by account_tree)
+typedef struct {
+    uint32_t flags;
+    uint32_t parent;
+    uint32_t firstChild;       // children form a circular list, as in memory
+    uint32_t nextSibling;
+    uint32_t prevSibling;
+    uint32_t extentCount;
+    uint64_t contentBytes;
+    uint64_t blockCount;
+    blk_t mapBlock;            // overflow extent chain, NO_BLOCK if none
+    DiskExtent ext[INLINE_EXTENTS];   // or the bytes of an INODE_INLINE file
+    char name[MAX_NAME+1];
+} DiskInode;
+
+// Extents beyond INLINE_EXTENTS spill into a chain of data blocks
+typedef struct {
+    blk_t next;
+    uint32_t count;
+    uint32_t reserved;
+    DiskExtent ext[];
+} MapBlock;
+
+#define MAP_BLOCK_EXTENTS ((int)((blockSize - sizeof(MapBlock)) / sizeof(DiskExtent)))
+
+// Attributes of inode i are inodeAttrs[i]. User xattrs are packed into
+// one block: entries of [name length][value length][name][value].
+#define ATTR_NAME_MAX  32
+#define ATTR_VALUE_MAX 255
+
+typedef struct {
+    int64_t mtime;             // seconds since the epoch
+    blk_t xattrBlock;          // valid while xattrLen > 0
+    uint32_t xattrLen;
+    uint32_t xattrCount;
+} InodeAttr;
+
+unsigned char *imageBase = NULL;   // metadata region (superblock..bitmap)
+size_t metaSize = 0;
+size_t dataSize = 0;
+int imageFd = -1;              // -1: anonymous in-memory disk
+SuperBlock *super = NULL;
+DiskInode *inodeTable = NULL;
+InodeAttr *inodeAttrs = NULL;  // NULL on images made without FEATURE_ATTRS
+
+/* Metadata journal (image files only). The metadata region is mapped
+ * privately, so changes stay in memory until commit: the changed pages
+ * are appended to <image>.journal and fsync'd, and only then written
+ * back to the image. Many operations share one commit (group commit). */
+#define JOURNAL_MAGIC     0x4C4E524Au
+#define JREC_PAGE         1
+#define JREC_COMMIT       2
+#define GROUP_COMMIT_OPS  64
+#define GROUP_COMMIT_MS   50
+#define JOURNAL_MAX_BYTES (8 << 20)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;
+    uint32_t page;             // page number, or page count for a commit
+    uint32_t checksum;         // commit: FNV-1a over the transaction's pages
+} JournalRecord;
+
+typedef struct {
+    blk_t start;
+    uint64_t len;
+} BlockRun;
 
-// Free block node
-typedef struct FreeBlockNode {
-    int index;
-    struct FreeBlockNode *prev;
-    struct FreeBlockNode *next;
-} FreeBlockNode;
+int journalFd = -1;
+uint64_t journalSeq = 1;
+size_t journalBytes = 0;
+unsigned char *pageDirty = NULL;   // one flag per metadata page
+uint32_t *dirtyPages = NULL;
+int dirtyCount = 0;             // updated atomically: commands dirty pages concurrently
+int txOps = 0;
+long long txStartMs = 0;
 
-FreeBlockNode *freeListHead = NULL;
-FreeBlockNode *freeListTail = NULL;
-int freeBlockCount = 0;
+/* Block cache. Data is read and written through the shared mapping of
+ * the image, so the frames are the kernel's page cache; this layer
+ * decides which of them stay resident. It tracks frames (a page, or one
+ * block if blocks are larger) with CLOCK. A read miss asks the kernel to
+ * bring the frame in, readahead does the same a window ahead, and an
+ * evicted frame is written back if dirty, then unmapped and dropped from
+ * the page cache, so about cacheSize blocks of image data stay resident
+ * and a miss is a real read. An in-memory disk has nothing to drop: its
+ * cache is off.
+ *
+ * The frames are split over up to CACHE_SHARDS shards, each with its own
+ * lock, slots, map and clock hand. A stripe of CACHE_STRIPE consecutive
+ * frames lives in one shard, so a run usually takes one lock, and readers
+ * of different parts of the image rarely meet. A shard holds at least
+ * four stripes, so small caches get fewer shards. */
+#define RA_WINDOW 32
+
+typedef struct {
+    blk_t frame;               // NO_BLOCK if the slot is empty
+    unsigned char ref;
+    unsigned char dirty;
+} CacheSlot;
+
+// frame -> slot lookup: open addressing, linear probing, 2x oversized
+typedef struct {
+    blk_t frame;
+    int slot;
+} CacheMapEntry;
+
+#define CACHE_SHARDS 16
+#define CACHE_STRIPE 16        // consecutive frames per shard stripe
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheSlot *slots;
+    CacheMapEntry *map;
+    int frames, mapSize;
+    int clockHand;
+    long long hits, misses, readahead, writebacks;
+} __attribute__((aligned(64))) CacheShard;
+
+CacheShard cacheShards[CACHE_SHARDS];
+int cacheShardCount = 0;
+uint64_t raWindow = RA_WINDOW;  // blocks; at most a quarter of a shard
+int cacheSize = 65536;         // in blocks (--cache)
+int cacheFrames = 0;           // 0: cache off
+size_t frameBytes = 0;
+uint64_t frameBlocks = 0;      // blocks per frame
+
+// blocks freed by the open transaction; reusable only after it commits
+BlockRun *pendingFree = NULL;
+int pendingFreeCount = 0;
+int pendingFreeCap = 0;
+
+/* Block sharing. A block referenced by n files has blockShares[b] ==
+ * n - 1; the table sits in the image before the bitmap. Copies (cp,
+ * snapshot) share blocks; on dedup images so do identical writes. The
+ * fingerprint index (content hash -> block) is in memory
+ * only and fills as blocks are written; a hit is confirmed with memcmp
+ * before a block is shared. An indexed block is never modified in place
+ * or freed without first leaving the index. */
+typedef struct {
+    uint64_t hash;
+    blk_t block;               // NO_BLOCK if the slot is empty
+} DedupEntry;
+
+int sharingEnabled = 0;        // the image has a share table
+int dedupEnabled = 0;          // --dedup at format time; then from the image
+uint32_t *blockShares = NULL;
+uint64_t sharedRefs = 0;       // sum of blockShares
+uint64_t *dedupIndexed = NULL; // one bit per block: has an index entry
+DedupEntry *dedupIndex = NULL;
+uint64_t dedupIndexSize = 0;
+uint64_t dedupIndexCount = 0;
+long long dedupHits = 0;
+pthread_mutex_t dedupLock = PTHREAD_MUTEX_INITIALIZER;   // the index and blockShares
+
+// Block allocation bitmap: one bit per block, set = in use
+uint64_t *blockBitmap = NULL;
+uint64_t bitmapWords = 0;
+uint64_t freeBlockCount = 0;   // updated atomically
+
+/* The bitmap is split into shards by word range, each with its own lock
+ * and next-fit cursor. A thread allocates from its home shard first, so
+ * concurrent writers rarely meet; runs never cross a shard boundary. */
+#define ALLOC_SHARDS 16
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t firstWord, endWord;
+    uint64_t hint;             // next-fit cursor (word index)
+} AllocShard;
+
+AllocShard allocShards[ALLOC_SHARDS];
+int shardCount = 0;
+int nextHomeShard = 0;
+__thread int homeShard = -1;
+
+// A run of physical blocks backing logical blocks [logical, logical+len)
+typedef struct {
+    uint64_t logical;
+    blk_t start;
+    uint64_t len;
+} Extent;
 
 // Basic file/directory node
 typedef struct FSNode {
-    char name[MAX_NAME+1];
+    const char *name;          // interned, see Node slabs
     int isDirectory;
 
     struct FSNode *parent;
@@ -31,568 +273,5480 @@ typedef struct FSNode {
     struct FSNode *nextSibling;
     struct FSNode *prevSibling;
 
-    // file data
-    int *blockIndex;
-    int blockCount;
-    int contentBytes;
+    // directory name index (chained through hashNext)
+    struct FSNode **childTable;
+    int tableSize;
+    int childCount;
+    struct FSNode *hashNext;
+
+    char *path;                // cached canonical path (built on demand)
+
+    // backing inode; children (dir) or block map (file) are read from
+    // the inode table on first access
+    uint32_t ino;
+    int loaded;
+
+    // file data: extents in logical order, so metadata grows with
+    // fragmentation rather than file size
+    Extent *extents;
+    int extentCount;
+    int extentCap;
+    uint64_t blockCount;
+    uint64_t raNext;           // next logical block if reads stay sequential
+    uint64_t contentBytes;
+    int mapDirty;              // extents remapped since the map was stored
+    int compressed;            // extent g is the frame of group g (see Compressed files)
+    int inlined;               // bytes live in the inode, no extents (see Inline files)
+
+    pthread_rwlock_t lock;     // file contents: readers share, writers exclusive
+    int cwdRefs;               // sessions whose working directory this is
 } FSNode;
 
 FSNode *rootDir = NULL;
-FSNode *currentDir = NULL;
 
-/* ------------------------ Free block list ------------------------ */
+// A client of the VFS with its own working directory and output stream.
+// The REPL is one session; the server runs one per connection.
+typedef struct {
+    FSNode *cwd;
+    FILE *in;                  // command input (heredoc bodies are read from it)
+    FILE *out;
+    int closing;               // set by "exit"
+    int remote;                // a socket client: host files are off limits
+} VfsSession;
 
-void init_free_blocks() {
-    freeListHead = freeListTail = NULL;
-    freeBlockCount = 0;
+/* Locking. Every command holds txLock shared and a journal commit takes
+ * it exclusively, so a transaction never captures half an operation.
+ * nsLock guards the tree shape: lookups and file I/O take it shared,
+ * create/mkdir/delete/rmdir exclusively. File contents are guarded by
+ * the node's own rwlock. Lock order: txLock, nsLock, node lock, then the
+ * leaf locks (loadLock, allocator shards, cache shards, pendingLock,
+ * dcache stripes). */
+pthread_rwlock_t txLock;
+pthread_rwlock_t nsLock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t loadLock = PTHREAD_MUTEX_INITIALIZER;   // lazy loads under a shared nsLock
+pthread_mutex_t pendingLock = PTHREAD_MUTEX_INITIALIZER;
+int serverMode = 0;             // commands run on several threads (sessions, defragmenter)
 
-    for (int i = 0; i < TOTAL_BLOCKS; i++) {
-        FreeBlockNode *n = malloc(sizeof(FreeBlockNode));
-        n->index = i;
-        n->next = NULL;
-        n->prev = freeListTail;
+int is_loaded(FSNode *n);
+void load_dir(FSNode *dir);
 
-        if (!freeListHead) freeListHead = n;
-        if (freeListTail) freeListTail->next = n;
-        freeListTail = n;
+// Counters for stats and --bench, bumped with relaxed atomics
+typedef struct {
+    long long allocCalls, allocFails, blocksAllocated, blocksFreed;
+    long long pathLookups, dcacheHits, dcacheMisses, childLookups;
+    long long bytesWritten, bytesRead, commits, journalWritten;
+    long long defragBlocks, defragMoves;
+} VfsCounters;
 
-        freeBlockCount++;
-    }
+VfsCounters counters;
+
+#define COUNT(field, n) __atomic_add_fetch(&counters.field, (n), __ATOMIC_RELAXED)
+
+void snapshot_counters(VfsCounters *c) {
+    const long long *src = (const long long *)&counters;
+    long long *dst = (long long *)c;
+    for (size_t i = 0; i < sizeof(VfsCounters) / sizeof(long long); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
 }
 
-int pop_free_block() {
-    if (!freeListHead) return -1;
-    FreeBlockNode *temp = freeListHead;
-    int idx = temp->index;
+// Dentry cache: (start dir, multi-component path) -> node.
+// Entries are invalidated wholesale by bumping dcacheGen on any unlink.
+#define DCACHE_SIZE     1024
+#define DCACHE_PATH_MAX 128
 
-    freeListHead = temp->next;
-    if (freeListHead) freeListHead->prev = NULL;
-    else freeListTail = NULL;
-    free(temp);
+typedef struct {
+    FSNode *base;
+    FSNode *node;
+    unsigned int gen;
+    char path[DCACHE_PATH_MAX];
+} DentryEntry;
 
-    freeBlockCount--;
-    return idx;
-}
+#define DCACHE_LOCKS    64
 
-// append freed block to tail
-void push_free_block(int idx) {
-    FreeBlockNode *n = malloc(sizeof(FreeBlockNode));
-    n->index = idx;
-    n->next = NULL;
-    n->prev = freeListTail;
+DentryEntry dcache[DCACHE_SIZE];
+unsigned int dcacheGen = 1;    // bumped under an exclusive nsLock
+pthread_mutex_t dcacheLocks[DCACHE_LOCKS];
 
-    if (freeListTail) freeListTail->next = n;
-    freeListTail = n;
-    if (!freeListHead) freeListHead = n;
+/* ------------------------ Dirty tracking ------------------------ */
 
-    freeBlockCount++;
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void free_entire_free_list() {
-    FreeBlockNode *t = freeListHead;
-    while (t) {
-        FreeBlockNode *nx = t->next;
-        free(t);
-        t = nx;
-    }
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-/* ------------------------ File node helpers ------------------------ */
+// Record that [p, p+len) of the metadata region changed in this transaction
+void mark_dirty(const void *p, size_t len) {
+    if (journalFd < 0) return;
+    size_t off = (const unsigned char *)p - imageBase;
+    for (size_t pg = off / IMAGE_ALIGN; pg <= (off + len - 1) / IMAGE_ALIGN; pg++) {
+        if (__atomic_test_and_set(&pageDirty[pg], __ATOMIC_ACQ_REL)) continue;
+        int slot = __atomic_fetch_add(&dirtyCount, 1, __ATOMIC_ACQ_REL);
+        if (slot == 0) __atomic_store_n(&txStartMs, now_ms(), __ATOMIC_RELAXED);
+        dirtyPages[slot] = pg;
+    }
+}
 
-FSNode *new_node(const char *name, int isDir) {
-    FSNode *n = malloc(sizeof(FSNode));
-    strncpy(n->name, name, MAX_NAME);
-    n->name[MAX_NAME] = '\0';
+// Anything for the next commit to do?
+int tx_pending() {
+    return __atomic_load_n(&dirtyCount, __ATOMIC_ACQUIRE) > 0 ||
+           __atomic_load_n(&pendingFreeCount, __ATOMIC_ACQUIRE) > 0;
+}
 
-    n->isDirectory = isDir;
-    n->parent = NULL;
-    n->child = NULL;
-    n->nextSibling = n->prevSibling = NULL;
+/* ------------------------ Block allocator ------------------------ */
 
-    n->blockIndex = NULL;
-    n->blockCount = 0;
-    n->contentBytes = 0;
-    return n;
+int block_in_use(blk_t idx) {
+    return (blockBitmap[idx >> 6] >> (idx & 63)) & 1;
 }
 
-void add_child(FSNode *parent, FSNode *child) {
-    child->parent = parent;
-    if (!parent->child) {
-        parent->child = child;
-        child->nextSibling = child->prevSibling = child;
-    } else {
-        FSNode *first = parent->child;
-        FSNode *last = first->prevSibling;
-        last->nextSibling = child;
-        child->prevSibling = last;
-        child->nextSibling = first;
-        first->prevSibling = child;
+// Split the bitmap into shards; called whenever an image is attached
+void init_alloc_shards() {
+    shardCount = bitmapWords < ALLOC_SHARDS ? (int)bitmapWords : ALLOC_SHARDS;
+    for (int i = 0; i < shardCount; i++) {
+        AllocShard *sh = &allocShards[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->firstWord = bitmapWords * i / shardCount;
+        sh->endWord = bitmapWords * (i + 1) / shardCount;
+        sh->hint = sh->firstWord;
     }
 }
 
-// Remove from circular sibling list
-void detach_child(FSNode *parent, FSNode *child) {
-    if (!parent->child) return;
+AllocShard *shard_of(uint64_t word) {
+    int i = (int)(word * shardCount / bitmapWords);
+    while (word >= allocShards[i].endWord) i++;
+    while (word < allocShards[i].firstWord) i--;
+    return &allocShards[i];
+}
 
-    if (child->nextSibling == child && child->prevSibling == child) {
-        parent->child = NULL;
-    } else {
-        child->prevSibling->nextSibling = child->nextSibling;
-        child->nextSibling->prevSibling = child->prevSibling;
-        if (parent->child == child)
-            parent->child = child->nextSibling;
-    }
-    child->nextSibling = child->prevSibling = NULL;
-    child->parent = NULL;
+// Called once when formatting; the bitmap itself lives in the image.
+void init_free_blocks() {
+    memset(blockBitmap, 0, (size_t)bitmapWords * sizeof(uint64_t));
+    freeBlockCount = TOTAL_BLOCKS;
+    super->freeBlocks = freeBlockCount;
+
+    // bits past the last block are permanently "used" so scans skip them
+    int tail = TOTAL_BLOCKS & 63;
+    if (tail) blockBitmap[bitmapWords - 1] = ~0ULL << tail;
 }
 
-// search in cwd
-FSNode *find_in_current(const char *name) {
-    if (!currentDir->child) return NULL;
-    FSNode *c = currentDir->child;
-    do {
-        if (strcmp(c->name, name) == 0) return c;
-        c = c->nextSibling;
-    } while (c != currentDir->child);
+// Next-fit within one shard; caller holds the shard lock
+uint64_t shard_alloc(AllocShard *sh, uint64_t want, blk_t *start) {
+    uint64_t words = sh->endWord - sh->firstWord;
+    blk_t limit = sh->endWord * 64 < TOTAL_BLOCKS ? sh->endWord * 64 : TOTAL_BLOCKS;
 
-    return NULL;
+    for (uint64_t n = 0; n < words; n++) {
+        uint64_t w = sh->firstWord + (sh->hint - sh->firstWord + n) % words;
+        if (blockBitmap[w] == ~0ULL) continue;
+
+        blk_t first = w * 64 + __builtin_ctzll(~blockBitmap[w]);
+        uint64_t len = 0;
+        while (len < want && first + len < limit && !block_in_use(first + len)) {
+            blk_t idx = first + len;
+            uint64_t word = blockBitmap[idx >> 6];
+            int bit = idx & 63;
+
+            // whole free word ahead and still room: take it in one step
+            if (bit == 0 && word == 0 && want - len >= 64) {
+                blockBitmap[idx >> 6] = ~0ULL;
+                len += 64;
+                continue;
+            }
+            blockBitmap[idx >> 6] |= 1ULL << bit;
+            len++;
+        }
+
+        sh->hint = (first + len) >> 6;
+        if (sh->hint >= sh->endWord) sh->hint = sh->firstWord;
+        *start = first;
+        return len;
+    }
+    return 0;
 }
 
-/* ------------------------ Commands ------------------------ */
+// Allocate up to 'want' contiguous blocks. Returns the run length
+// (0 if the disk is full) and stores the first block in *start.
+uint64_t alloc_block_run(uint64_t want, blk_t *start) {
+    if (want == 0) return 0;
+    COUNT(allocCalls, 1);
+    if (__atomic_load_n(&freeBlockCount, __ATOMIC_RELAXED) == 0) {
+        COUNT(allocFails, 1);
+        return 0;
+    }
+    if (homeShard < 0)
+        homeShard = __atomic_fetch_add(&nextHomeShard, 1, __ATOMIC_RELAXED) % shardCount;
 
-// mkdir
-void do_mkdir(char *name) {
-    if (!name) {
-        printf("Usage: mkdir <name>\n");
-        return;
+    for (int k = 0; k < shardCount; k++) {
+        AllocShard *sh = &allocShards[(homeShard + k) % shardCount];
+        pthread_mutex_lock(&sh->lock);
+        uint64_t len = shard_alloc(sh, want, start);
+        pthread_mutex_unlock(&sh->lock);
+        if (!len) continue;
+
+        blk_t first = *start;
+        __atomic_sub_fetch(&freeBlockCount, len, __ATOMIC_RELAXED);
+        COUNT(blocksAllocated, len);
+        mark_dirty(&blockBitmap[first >> 6], (size_t)(((first + len - 1) >> 6) - (first >> 6) + 1) * sizeof(uint64_t));
+        return len;
     }
-    if (find_in_current(name)) {
-        printf("Already exists.\n");
-        return;
+    COUNT(allocFails, 1);
+    return 0;
+}
+
+void clear_block_run(blk_t start, uint64_t len) {
+    blk_t i = start, end = start + len;
+    while (i < end) {
+        // a merged extent may straddle shards: clear it piece by piece
+        AllocShard *sh = shard_of(i >> 6);
+        blk_t stop = sh->endWord * 64 < end ? sh->endWord * 64 : end;
+        pthread_mutex_lock(&sh->lock);
+        while (i < stop) {
+            if ((i & 63) == 0 && stop - i >= 64) {
+                blockBitmap[i >> 6] = 0;
+                i += 64;
+            } else {
+                blockBitmap[i >> 6] &= ~(1ULL << (i & 63));
+                i++;
+            }
+        }
+        pthread_mutex_unlock(&sh->lock);
     }
-    FSNode *d = new_node(name, 1);
-    add_child(currentDir, d);
-    printf("Directory '%s' created.\n", name);
+    __atomic_add_fetch(&freeBlockCount, len, __ATOMIC_RELAXED);
+    COUNT(blocksFreed, len);
+    mark_dirty(&blockBitmap[start >> 6], (size_t)(((end - 1) >> 6) - (start >> 6) + 1) * sizeof(uint64_t));
 }
 
-void do_create(char *name) {
-    if (!name) {
-        printf("Usage: create <name>\n");
+// With a journal, freed blocks stay allocated until the transaction that
+// frees them commits, so committed metadata never points at reused blocks.
+void queue_free_run(blk_t start, uint64_t len) {
+    if (journalFd < 0) {
+        clear_block_run(start, len);
         return;
     }
-    if (find_in_current(name)) {
-        printf("Already exists.\n");
-        return;
+    pthread_mutex_lock(&pendingLock);
+    if (pendingFreeCount == pendingFreeCap) {
+        pendingFreeCap = pendingFreeCap ? pendingFreeCap * 2 : 64;
+        pendingFree = realloc(pendingFree, sizeof(BlockRun) * pendingFreeCap);
     }
-    FSNode *f = new_node(name, 0);
-    add_child(currentDir, f);
-    printf("File '%s' created.\n", name);
+    pendingFree[pendingFreeCount].start = start;
+    pendingFree[pendingFreeCount].len = len;
+    __atomic_store_n(&pendingFreeCount, pendingFreeCount + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pendingLock);
 }
 
-// list
-void do_ls() {
-    if (!currentDir->child) {
-        printf("(empty)\n");
-        return;
-    }
-    FSNode *c = currentDir->child;
-    do {
-        printf("%s%s\n", c->name, c->isDirectory ? "/" : "");
-        c = c->nextSibling;
-    } while (c != currentDir->child);
+void drop_block_refs(blk_t start, uint64_t len);
+
+// Release a file's reference to a run of blocks
+void free_block_run(blk_t start, uint64_t len) {
+    if (sharingEnabled) drop_block_refs(start, len);
+    else queue_free_run(start, len);
 }
 
-// write to file (overwrite)
-void write_file_data(FSNode *file, const char *data) {
-    int len = strlen(data);
-    int needed = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+blk_t pop_free_block() {
+    blk_t idx;
+    return alloc_block_run(1, &idx) ? idx : NO_BLOCK;
+}
 
-    if (needed > freeBlockCount) {
-        printf("Disk full.\n");
-        return;
-    }
+void push_free_block(blk_t idx) {
+    free_block_run(idx, 1);
+}
 
-    // free old
-    for (int i = 0; i < file->blockCount; i++)
-        push_free_block(file->blockIndex[i]);
+// Return a file's extents to the allocator, one call per extent
+void free_extents(const Extent *ext, int count) {
+    for (int i = 0; i < count; i++)
+        free_block_run(ext[i].start, ext[i].len);
+}
 
-    free(file->blockIndex);
+/* ------------------------ Block sharing ------------------------ */
 
-    if (len == 0) {
-        file->blockIndex = NULL;
-        file->blockCount = 0;
-        file->contentBytes = 0;
-        printf("(empty data)\n");
-        return;
+uint64_t block_fingerprint(const unsigned char *p) {
+    const uint64_t *w = (const uint64_t *)p;
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ blockSize;
+    for (uint32_t i = 0; i < blockSize / 8; i++) {
+        h ^= w[i] * 0xFF51AFD7ED558CCDULL;
+        h = ((h << 27) | (h >> 37)) * 0xC4CEB9FE1A85EC53ULL;
     }
+    return h ^ (h >> 29);
+}
 
-    file->blockIndex = malloc(sizeof(int) * needed);
-    file->blockCount = needed;
-    file->contentBytes = len;
+unsigned char *block_data(blk_t b) {
+    return diskMemory + b * blockSize;
+}
 
-    int w = 0;
-    for (int i = 0; i < needed; i++) {
-        int idx = pop_free_block();
-        file->blockIndex[i] = idx;
+void init_dedup() {
+    if (!dedupEnabled) return;
+    dedupIndexed = calloc(bitmapWords, sizeof(uint64_t));
+    dedupIndexSize = 1024;
+    dedupIndexCount = 0;
+    dedupIndex = malloc(sizeof(DedupEntry) * dedupIndexSize);
+    for (uint64_t i = 0; i < dedupIndexSize; i++) dedupIndex[i].block = NO_BLOCK;
+}
 
-        int chunk = BLOCK_SIZE;
-        if (w + chunk > len) chunk = len - w;
-        memcpy(diskMemory + idx * BLOCK_SIZE, data + w, chunk);
+void free_dedup() {
+    free(dedupIndexed);
+    free(dedupIndex);
+    dedupIndexed = NULL;
+    dedupIndex = NULL;
+}
 
-        if (chunk < BLOCK_SIZE)
-            memset(diskMemory + idx * BLOCK_SIZE + chunk, 0, BLOCK_SIZE - chunk);
+int dedup_is_indexed(blk_t b) {
+    return (dedupIndexed[b >> 6] >> (b & 63)) & 1;
+}
 
-        w += chunk;
-    }
+// The index below is open addressing with linear probing, one entry per
+// hash; the caller holds dedupLock throughout.
+DedupEntry *dedup_find(uint64_t h) {
+    uint64_t mask = dedupIndexSize - 1;
+    for (uint64_t i = h & mask; dedupIndex[i].block != NO_BLOCK; i = (i + 1) & mask)
+        if (dedupIndex[i].hash == h) return &dedupIndex[i];
+    return NULL;
+}
+
+void dedup_insert(uint64_t h, blk_t b);
 
-    printf("Written %d bytes.\n", len);
+void dedup_grow() {
+    DedupEntry *old = dedupIndex;
+    uint64_t oldSize = dedupIndexSize;
+    dedupIndexSize *= 2;
+    dedupIndexCount = 0;
+    dedupIndex = malloc(sizeof(DedupEntry) * dedupIndexSize);
+    for (uint64_t i = 0; i < dedupIndexSize; i++) dedupIndex[i].block = NO_BLOCK;
+    for (uint64_t i = 0; i < oldSize; i++)
+        if (old[i].block != NO_BLOCK) dedup_insert(old[i].hash, old[i].block);
+    free(old);
 }
 
-void do_write(char *filename, char *text) {
-    FSNode *f = find_in_current(filename);
-    if (!f) {
-        printf("File not found.\n");
-        return;
-    }
-    if (f->isDirectory) {
-        printf("Can't write to directory.\n");
-        return;
+// Index block b under h, displacing whatever block had that hash
+void dedup_insert(uint64_t h, blk_t b) {
+    DedupEntry *e = dedup_find(h);
+    if (e) {
+        dedupIndexed[e->block >> 6] &= ~(1ULL << (e->block & 63));
+    } else {
+        if ((dedupIndexCount + 1) * 2 > dedupIndexSize) dedup_grow();
+        uint64_t mask = dedupIndexSize - 1, i = h & mask;
+        while (dedupIndex[i].block != NO_BLOCK) i = (i + 1) & mask;
+        e = &dedupIndex[i];
+        e->hash = h;
+        dedupIndexCount++;
     }
-    write_file_data(f, text);
+    e->block = b;
+    dedupIndexed[b >> 6] |= 1ULL << (b & 63);
 }
 
-void do_read(char *name) {
-    FSNode *f = find_in_current(name);
-    if (!f) {
-        printf("Not found.\n");
-        return;
-    }
-    if (f->isDirectory) {
-        printf("'%s' is a directory.\n", name);
-        return;
-    }
-    if (f->blockCount == 0) {
-        printf("(empty)\n");
-        return;
-    }
+// Take block b out of the index before its content changes or it is freed
+void dedup_forget(blk_t b) {
+    if (!dedupEnabled || !dedup_is_indexed(b)) return;
+    dedupIndexed[b >> 6] &= ~(1ULL << (b & 63));
 
-    int remain = f->contentBytes;
-    for (int i = 0; i < f->blockCount; i++) {
-        int idx = f->blockIndex[i];
-        int chunk = remain < BLOCK_SIZE ? remain : BLOCK_SIZE;
-        fwrite(diskMemory + idx * BLOCK_SIZE, 1, chunk, stdout);
-        remain -= chunk;
+    DedupEntry *e = dedup_find(block_fingerprint(block_data(b)));
+    if (!e || e->block != b) return;
+
+    // linear-probing delete, as in the cache map
+    uint64_t mask = dedupIndexSize - 1, i = e - dedupIndex;
+    dedupIndex[i].block = NO_BLOCK;
+    dedupIndexCount--;
+    for (uint64_t j = (i + 1) & mask; dedupIndex[j].block != NO_BLOCK; j = (j + 1) & mask) {
+        uint64_t home = dedupIndex[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            dedupIndex[i] = dedupIndex[j];
+            dedupIndex[j].block = NO_BLOCK;
+            i = j;
+        }
     }
-    printf("\n");
 }
 
-// delete file
-void do_delete(char *name) {
-    FSNode *f = find_in_current(name);
-    if (!f) {
-        printf("Not found.\n");
-        return;
-    }
-    if (f->isDirectory) {
-        printf("Use rmdir.\n");
-        return;
+void set_shares(blk_t b, uint32_t n) {
+    sharedRefs += (int64_t)n - (int64_t)blockShares[b];
+    blockShares[b] = n;
+    mark_dirty(&blockShares[b], sizeof(uint32_t));
+}
+
+// Drop one reference from each block of a run; caller holds dedupLock.
+// Blocks nobody else uses leave the index and are freed in runs.
+void drop_refs_locked(blk_t start, uint64_t len) {
+    blk_t runStart = start;
+    for (blk_t b = start; b < start + len; b++) {
+        if (blockShares[b] == 0) {
+            dedup_forget(b);
+            continue;
+        }
+        set_shares(b, blockShares[b] - 1);
+        if (b > runStart) queue_free_run(runStart, b - runStart);
+        runStart = b + 1;
     }
-    for (int i = 0; i < f->blockCount; i++)
-        push_free_block(f->blockIndex[i]);
+    if (start + len > runStart) queue_free_run(runStart, start + len - runStart);
+}
 
-    free(f->blockIndex);
-    detach_child(currentDir, f);
-    free(f);
-    printf("File removed.\n");
+void drop_block_refs(blk_t start, uint64_t len) {
+    pthread_mutex_lock(&dedupLock);
+    drop_refs_locked(start, len);
+    pthread_mutex_unlock(&dedupLock);
 }
 
-void do_rmdir(char *name) {
-    FSNode *d = find_in_current(name);
-    if (!d) {
-        printf("Not found.\n");
-        return;
-    }
-    if (!d->isDirectory) {
-        printf("Not a directory.\n");
-        return;
+// One more reference to every block of a file's extents (a copy)
+void share_extents(const Extent *ext, int count) {
+    pthread_mutex_lock(&dedupLock);
+    for (int i = 0; i < count; i++)
+        for (blk_t b = ext[i].start; b < ext[i].start + ext[i].len; b++)
+            set_shares(b, blockShares[b] + 1);
+    pthread_mutex_unlock(&dedupLock);
+}
+
+/* ------------------------ Journal ------------------------ */
+
+uint32_t fnv_bytes(uint32_t h, const unsigned char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
     }
-    if (d->child) {
-        printf("Directory not empty.\n");
-        return;
+    return h;
+}
+
+int write_all(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
     }
-    detach_child(currentDir, d);
-    free(d);
-    printf("Removed dir.\n");
+    return 0;
 }
 
-// cd
-void do_cd(char *name) {
-    if (!name) {
-        printf("Usage: cd <dir>\n");
-        return;
+// Write to out through its stdio buffer when set, else straight to fd
+int put_bytes(int fd, FILE *out, const void *buf, size_t len) {
+    if (out) return fwrite(buf, 1, len, out) == len ? 0 : -1;
+    return write_all(fd, buf, len);
+}
+
+// Clear blocks [start, start+len) in the logged copies of the bitmap
+// pages; pageRec maps a bitmap page (from the first) to its record
+void clear_logged_bits(unsigned char *buf, size_t recSize, const int *pageRec, blk_t start, uint64_t len) {
+    size_t first = ((unsigned char *)blockBitmap - imageBase) / IMAGE_ALIGN;
+    for (blk_t i = start, end = start + len; i < end; ) {
+        size_t off = (unsigned char *)&blockBitmap[i >> 6] - imageBase;
+        uint64_t *w = (uint64_t *)(buf + recSize * pageRec[off / IMAGE_ALIGN - first] +
+                                   sizeof(JournalRecord) + off % IMAGE_ALIGN);
+        if ((i & 63) == 0 && end - i >= 64) {
+            *w = 0;
+            i += 64;
+        } else {
+            *w &= ~(1ULL << (i & 63));
+            i++;
+        }
     }
-    if (strcmp(name, "/") == 0) {
-        currentDir = rootDir;
-        printf("Moved to /\n");
-        return;
+}
+
+// Make the open transaction durable: log its metadata pages, fsync the
+// journal once, then write the pages back to their home locations.
+// The caller makes sure no command is running (see journal_commit).
+//
+// Blocks freed by the transaction are cleared in the logged bitmap, but
+// the live bitmap only gets them once the journal is durable: until then
+// the committed metadata may still point at them. If logging fails they
+// stay pending for the next commit.
+void journal_commit_locked() {
+    if (journalFd < 0 || !tx_pending()) return;
+
+    uint64_t freeing = 0;
+    for (int i = 0; i < pendingFreeCount; i++) {
+        blk_t start = pendingFree[i].start, end = start + pendingFree[i].len;
+        mark_dirty(&blockBitmap[start >> 6], (size_t)(((end - 1) >> 6) - (start >> 6) + 1) * sizeof(uint64_t));
+        freeing += pendingFree[i].len;
     }
-    if (strcmp(name, "..") == 0) {
-        if (currentDir->parent)
-            currentDir = currentDir->parent;
 
-        // TODO: maybe simplify this path printing
-        FSNode *t = currentDir;
-        char p[4096] = "";
-        while (t && t != rootDir) {
-            char buf[256];
-            snprintf(buf, sizeof(buf), "/%s", t->name);
-            char tmp[4096];
-            strcpy(tmp, buf);
-            strcat(tmp, p);
-            strcpy(p, tmp);
-            t = t->parent;
-        }
-        if (strlen(p) == 0) strcpy(p, "/");
-        printf("Moved to %s\n", p);
-        return;
+    // the free and share counts are kept in memory while commands run
+    super->freeBlocks = freeBlockCount + freeing;
+    super->sharedRefs = sharedRefs;
+    mark_dirty(super, sizeof(*super));
+
+    // ordered mode: file data reaches the image before metadata that
+    // points at it
+    fdatasync(imageFd);
+
+    size_t recSize = sizeof(JournalRecord) + IMAGE_ALIGN;
+    size_t total = recSize * dirtyCount + sizeof(JournalRecord);
+    unsigned char *buf = malloc(total);
+    uint32_t sum = 2166136261u;
+
+    size_t bmFirst = ((unsigned char *)blockBitmap - imageBase) / IMAGE_ALIGN;
+    size_t bmPages = ((unsigned char *)(blockBitmap + bitmapWords) - 1 - imageBase) / IMAGE_ALIGN - bmFirst + 1;
+    int *pageRec = malloc(sizeof(int) * bmPages);
+
+    for (int i = 0; i < dirtyCount; i++) {
+        JournalRecord *r = (JournalRecord *)(buf + recSize * i);
+        r->magic = JOURNAL_MAGIC;
+        r->type = JREC_PAGE;
+        r->seq = journalSeq;
+        r->page = dirtyPages[i];
+        r->checksum = 0;
+        memcpy(r + 1, imageBase + (size_t)dirtyPages[i] * IMAGE_ALIGN, IMAGE_ALIGN);
+        if (dirtyPages[i] >= bmFirst && dirtyPages[i] - bmFirst < bmPages)
+            pageRec[dirtyPages[i] - bmFirst] = i;
     }
+    for (int i = 0; i < pendingFreeCount; i++)
+        clear_logged_bits(buf, recSize, pageRec, pendingFree[i].start, pendingFree[i].len);
+    free(pageRec);
+    for (int i = 0; i < dirtyCount; i++)
+        sum = fnv_bytes(sum, buf + recSize * i + sizeof(JournalRecord), IMAGE_ALIGN);
+    JournalRecord *c = (JournalRecord *)(buf + recSize * dirtyCount);
+    c->magic = JOURNAL_MAGIC;
+    c->type = JREC_COMMIT;
+    c->seq = journalSeq;
+    c->page = dirtyCount;
+    c->checksum = sum;
 
-    FSNode *d = find_in_current(name);
-    if (!d) {
-        printf("Not found.\n");
+    if (write_all(journalFd, buf, total) < 0 || fdatasync(journalFd) < 0) {
+        perror("journal");
+        free(buf);
         return;
     }
-    if (!d->isDirectory) {
-        printf("Not a dir.\n");
-        return;
+    free(buf);
+    COUNT(commits, 1);
+    COUNT(journalWritten, total);
+
+    // durable: the freed blocks may be reused (their bitmap pages are
+    // still dirty, so the checkpoint below writes the cleared bits)
+    for (int i = 0; i < pendingFreeCount; i++)
+        clear_block_run(pendingFree[i].start, pendingFree[i].len);
+    __atomic_store_n(&pendingFreeCount, 0, __ATOMIC_RELEASE);
+
+    // checkpoint
+    for (int i = 0; i < dirtyCount; i++) {
+        size_t off = (size_t)dirtyPages[i] * IMAGE_ALIGN;
+        if (pwrite(imageFd, imageBase + off, IMAGE_ALIGN, off) != IMAGE_ALIGN)
+            perror("checkpoint");
+        pageDirty[dirtyPages[i]] = 0;
     }
-    currentDir = d;
+    __atomic_store_n(&dirtyCount, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&txOps, 0, __ATOMIC_RELAXED);
+    journalSeq++;
+    journalBytes += total;
 
-    char p[4096] = "";
-    FSNode *t = currentDir;
-    while (t && t != rootDir) {
-        char buf[256];
-        snprintf(buf, sizeof(buf), "/%s", t->name);
-        char tmp[4096];
-        strcpy(tmp, buf);
-        strcat(tmp, p);
-        strcpy(p, tmp);
-        t = t->parent;
+    if (journalBytes > JOURNAL_MAX_BYTES) {
+        fdatasync(imageFd);
+        if (ftruncate(journalFd, 0) == 0) journalBytes = 0;
     }
-    if (strlen(p) == 0) strcpy(p, "/");
-    printf("Moved to %s\n", p);
 }
 
-void do_pwd() {
-    FSNode *t = currentDir;
-    if (t == rootDir) {
-        printf("/\n");
-        return;
-    }
-    char p[4096] = "";
-    while (t && t != rootDir) {
-        char buf[256];
-        snprintf(buf, sizeof(buf), "/%s", t->name);
-        char tmp[4096];
-        strcpy(tmp, buf);
-        strcat(tmp, p);
-        strcpy(p, tmp);
-        t = t->parent;
-    }
-    if (strlen(p) == 0) strcpy(p, "/");
-    printf("%s\n", p);
+void journal_commit() {
+    pthread_rwlock_wrlock(&txLock);
+    journal_commit_locked();
+    pthread_rwlock_unlock(&txLock);
 }
 
-void do_df() {
-    int used = TOTAL_BLOCKS - freeBlockCount;
-    double usage = (double)used / TOTAL_BLOCKS * 100.0;
-    printf("Total: %d\nUsed: %d\nFree: %d\nUsage: %.2f%%\n",
-            TOTAL_BLOCKS, used, freeBlockCount, usage);
+// Called after every command; commits once enough operations have been
+// batched or the transaction is old enough
+void journal_op_done() {
+    if (!tx_pending()) return;       // never pending without a journal
+    int ops = __atomic_add_fetch(&txOps, 1, __ATOMIC_RELAXED);
+    if (ops >= GROUP_COMMIT_OPS ||
+        now_ms() - __atomic_load_n(&txStartMs, __ATOMIC_RELAXED) >= GROUP_COMMIT_MS)
+        journal_commit();
 }
 
-// free everything (called on exit)
-void free_recursive(FSNode *n) {
-    if (!n) return;
-    if (n->child) {
-        FSNode *c = n->child;
-        do {
-            FSNode *nx = c->nextSibling;
-            free_recursive(c);
-            c = nx;
-        } while (c != n->child);
-    }
-    if (!n->isDirectory) {
-        for (int i = 0; i < n->blockCount; i++)
-            push_free_block(n->blockIndex[i]);
-        free(n->blockIndex);
-    }
-    free(n);
+/* Server sessions can't commit from inside a command (they hold txLock
+ * shared), so a background thread commits on request and by age. */
+pthread_mutex_t commitMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commitCond = PTHREAD_COND_INITIALIZER;
+int commitWanted = 0;
+int commitStop = 0;
+
+void request_commit() {
+    pthread_mutex_lock(&commitMutex);
+    commitWanted = 1;
+    pthread_cond_signal(&commitCond);
+    pthread_mutex_unlock(&commitMutex);
 }
 
-void do_exit() {
-    if (rootDir->child) {
-        FSNode *c = rootDir->child;
-        do {
-            FSNode *nx = c->nextSibling;
-            free_recursive(c);
-            c = nx;
-        } while (c != rootDir->child);
+void *commit_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&commitMutex);
+    while (!commitStop) {
+        if (!commitWanted) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += GROUP_COMMIT_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&commitCond, &commitMutex, &ts);
+        }
+        commitWanted = 0;
+        pthread_mutex_unlock(&commitMutex);
+        if (tx_pending()) journal_commit();
+        pthread_mutex_lock(&commitMutex);
     }
-    free(rootDir);
-    free_entire_free_list();
-    free(diskMemory);
-    printf("Goodbye.\n");
-    exit(0);
+    pthread_mutex_unlock(&commitMutex);
+    return NULL;
 }
 
-/* ---------------- Parsing helpers ---------------- */
+// Replay every complete transaction in the journal onto the image.
+// Returns the number of transactions applied.
+int journal_recover(int fd, int jfd) {
+    JournalRecord r;
+    unsigned char *pages = NULL;
+    uint32_t *pageNos = NULL;
+    int count = 0, cap = 0, applied = 0;
+    uint32_t sum = 2166136261u;
 
-char *remove_quotes(char *s) {
-    if (!s) return s;
-    size_t len = strlen(s);
-    if (len >= 2 && ((s[0] == '"' && s[len-1] == '"') ||
-                    (s[0] == '\'' && s[len-1] == '\''))) {
-        s[len-1] = '\0';
-        return s+1;
+    while (read(jfd, &r, sizeof(r)) == sizeof(r) && r.magic == JOURNAL_MAGIC) {
+        if (r.type == JREC_PAGE) {
+            if (count == cap) {
+                cap = cap ? cap * 2 : 16;
+                pages = realloc(pages, (size_t)cap * IMAGE_ALIGN);
+                pageNos = realloc(pageNos, sizeof(uint32_t) * cap);
+            }
+            unsigned char *pg = pages + (size_t)count * IMAGE_ALIGN;
+            if (read(jfd, pg, IMAGE_ALIGN) != IMAGE_ALIGN) break;
+            pageNos[count++] = r.page;
+            sum = fnv_bytes(sum, pg, IMAGE_ALIGN);
+        } else if (r.type == JREC_COMMIT) {
+            if (r.page != (uint32_t)count || r.checksum != sum) break;
+            for (int i = 0; i < count; i++)
+                pwrite(fd, pages + (size_t)i * IMAGE_ALIGN, IMAGE_ALIGN, (off_t)pageNos[i] * IMAGE_ALIGN);
+            applied++;
+            count = 0;
+            sum = 2166136261u;
+        } else {
+            break;
+        }
     }
-    return s;
+    free(pages);
+    free(pageNos);
+
+    if (applied) fdatasync(fd);
+    if (ftruncate(jfd, 0) != 0) perror("journal");
+    return applied;
 }
 
-void handle_input(char *line) {
-    while (*line && isspace((unsigned char)*line)) line++;
-    if (*line == '\0') return;
+/* ------------------------ Disk image ------------------------ */
 
-    char backup[8192];
-    strncpy(backup, line, sizeof(backup)-1);
-    backup[sizeof(backup)-1] = '\0';
+size_t align_up(size_t v) {
+    return (v + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+}
 
-    char *cmd = strtok(backup, " \t\n");
-    if (!cmd) return;
+void layout_image(SuperBlock *sb, uint64_t blocks, uint32_t inodes) {
+    memset(sb, 0, sizeof(*sb));
+    memcpy(sb->magic, IMAGE_MAGIC, 8);
+    sb->version = IMAGE_VERSION;
+    sb->blockSize = blockSize;
+    sb->totalBlocks = blocks;
+    sb->freeBlocks = blocks;
+    if (!inodes) inodes = blocks > MAX_INODES ? MAX_INODES : blocks;
+    sb->inodeCount = inodes < 64 ? 64 : inodes;
+    sb->freeInodes = sb->inodeCount - 1;       // root
+    sb->inodeHint = 1;
 
-    if (strcmp(cmd, "mkdir") == 0) {
-        do_mkdir(strtok(NULL, " \t\n"));
-    }
-    else if (strcmp(cmd, "create") == 0) {
-        do_create(strtok(NULL, " \t\n"));
-    }
-    else if (strcmp(cmd, "ls") == 0) {
-        do_ls();
-    }
-    else if (strcmp(cmd, "write") == 0) {
-        char *p = line;
-        while (*p && isspace(*p)) p++;
-        p += strlen("write");
-        while (*p && isspace(*p)) p++;
+    sb->inodeOff = IMAGE_ALIGN;
+    sb->attrOff = align_up(sb->inodeOff + (size_t)sb->inodeCount * sizeof(DiskInode));
+    // every new image can share blocks; dedup also fingerprints writes
+    sb->features |= FEATURE_SHARING | FEATURE_DIR_TOTALS | FEATURE_ATTRS |
+                    (dedupEnabled ? FEATURE_DEDUP : 0);
+    sb->refOff = align_up(sb->attrOff + (size_t)sb->inodeCount * sizeof(InodeAttr));
+    sb->bitmapOff = align_up(sb->refOff + (size_t)blocks * sizeof(uint32_t));
+    sb->dataOff = align_up(sb->bitmapOff + (size_t)((blocks + 63) / 64) * sizeof(uint64_t));
+    sb->imageSize = sb->dataOff + blocks * blockSize;
+}
 
-        char filename[256];
-        int i = 0;
-        while (*p && !isspace(*p) && i < 255)
-            filename[i++] = *p++;
-        filename[i] = '\0';
+// Point the globals at the regions of a mapped image
+void attach_image() {
+    super = (SuperBlock *)imageBase;
+    inodeTable = (DiskInode *)(imageBase + super->inodeOff);
+    inodeAttrs = super->features & FEATURE_ATTRS ? (InodeAttr *)(imageBase + super->attrOff) : NULL;
+    blockBitmap = (uint64_t *)(imageBase + super->bitmapOff);
 
-        while (*p && isspace(*p)) p++;
+    blockSize = super->blockSize;
+    TOTAL_BLOCKS = super->totalBlocks;
+    bitmapWords = (TOTAL_BLOCKS + 63) / 64;
+    freeBlockCount = super->freeBlocks;
+    init_alloc_shards();
 
-        char content[8192];
-        strncpy(content, p, sizeof(content)-1);
-        content[sizeof(content)-1] = '\0';
+    dedupEnabled = (super->features & FEATURE_DEDUP) != 0;
+    sharingEnabled = (super->features & (FEATURE_SHARING | FEATURE_DEDUP)) != 0;
+    blockShares = sharingEnabled ? (uint32_t *)(imageBase + super->refOff) : NULL;
+    sharedRefs = super->sharedRefs;
+    init_dedup();
+}
 
-        size_t L = strlen(content);
-        if (L > 0 && content[L-1] == '\n')
-            content[L-1] = '\0';
+// Lay out a fresh (zero-filled) mapping
+void format_image(const SuperBlock *sb) {
+    memcpy(imageBase, sb, sizeof(*sb));
+    attach_image();
+    init_free_blocks();
 
-        char *c = remove_quotes(content);
+    DiskInode *root = &inodeTable[0];
+    root->flags = INODE_USED | INODE_DIR;
+    root->parent = root->firstChild = NO_INODE;
+    root->nextSibling = root->prevSibling = NO_INODE;
+    root->mapBlock = NO_BLOCK;
+    strcpy(root->name, "/");
+    inodeAttrs[0].mtime = time(NULL);
+}
 
-        // interpret only \n
-        char parsed[8192];
-        int pi = 0;
-        for (int k = 0; k < strlen(c); k++) {
-            if (c[k] == '\\' && c[k+1] == 'n') {
-                parsed[pi++] = '\n';
-                k++;
-            } else parsed[pi++] = c[k];
-        }
-        parsed[pi] = '\0';
+int map_regions(int fd, const SuperBlock *sb) {
+    metaSize = sb->dataOff;
+    dataSize = sb->totalBlocks * sb->blockSize;
 
-        do_write(filename, parsed);
-    }
-    else if (strcmp(cmd, "read") == 0) {
-        do_read(strtok(NULL, " \t\n"));
-    }
-    else if (strcmp(cmd, "delete") == 0) {
-        do_delete(strtok(NULL, " \t\n"));
-    }
-    else if (strcmp(cmd, "rmdir") == 0) {
-        do_rmdir(strtok(NULL, " \t\n"));
-    }
-    else if (strcmp(cmd, "cd") == 0) {
-        do_cd(strtok(NULL, " \t\n"));
-    }
-    else if (strcmp(cmd, "pwd") == 0) {
-        do_pwd();
-    }
-    else if (strcmp(cmd, "df") == 0) {
-        do_df();
-    }
-    else if (strcmp(cmd, "exit") == 0) {
-        do_exit();
+    if (fd < 0) {
+        // large in-memory disks are only backed as they are touched
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+        imageBase = mmap(NULL, metaSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+        diskMemory = mmap(NULL, dataSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+    } else {
+        // metadata private (written back by the journal), data shared
+        imageBase = mmap(NULL, metaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        diskMemory = mmap(NULL, dataSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, sb->dataOff);
     }
-    else {
-        printf("Unknown command: %s\n", cmd);
+    if (imageBase == MAP_FAILED || diskMemory == MAP_FAILED) {
+        perror("mmap");
+        return -1;
     }
+    return 0;
 }
 
-void init_vfs(int blocks) {
-    if (blocks < 1) blocks = 1;
-    if (blocks > 5000) blocks = 5000;
-
-    TOTAL_BLOCKS = blocks;
-    diskMemory = malloc((size_t)TOTAL_BLOCKS * BLOCK_SIZE);
-    memset(diskMemory, 0, (size_t)TOTAL_BLOCKS * BLOCK_SIZE);
+void rebuild_dir_totals();
 
-    init_free_blocks();
-    rootDir = new_node("/", 1);
-    currentDir = rootDir;
-}
+// Map an image file (formatting it if new or empty), or an anonymous
+// in-memory disk when path is NULL. Mounting replays the journal and
+// maps the regions; it does not scan the image (except once, to add
+// directory totals to an image made without them).
+int open_image(const char *path, uint64_t blocks, uint32_t inodes) {
+    SuperBlock sb;
 
-/* ---------------- main ---------------- */
+    if (!path) {
+        layout_image(&sb, blocks, inodes);
+        if (map_regions(-1, &sb) < 0) return -1;
+        format_image(&sb);
+        return 0;
+    }
 
-int main(int argc, char **argv) {
-    int blocks = 1024;
-    if (argc >= 2) {
-        int n = atoi(argv[1]);
-        if (n > 0) blocks = n;
+    imageFd = open(path, O_RDWR | O_CREAT, 0644);
+    if (imageFd < 0) {
+        perror(path);
+        return -1;
+    }
+    char jpath[4096];
+    snprintf(jpath, sizeof(jpath), "%s.journal", path);
+    int jfd = open(jpath, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (jfd < 0) {
+        perror(jpath);
+        return -1;
     }
-    init_vfs(blocks);
 
-    printf("VFS ready. Type 'exit' to quit.\n");
+    struct stat st;
+    fstat(imageFd, &st);
 
-    char prompt[512];
-    char line[8192];
+    int fresh = st.st_size == 0;
+    if (fresh) {
+        layout_image(&sb, blocks, inodes);
+        if (ftruncate(imageFd, sb.imageSize) != 0) {
+            perror(path);
+            return -1;
+        }
+    } else {
+        int n = journal_recover(imageFd, jfd);
+        if (n) printf("Recovered %d journal transaction(s).\n", n);
 
-    while (1) {
-        if (currentDir == rootDir) strcpy(prompt, "/ > ");
+        if (pread(imageFd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+            memcmp(sb.magic, IMAGE_MAGIC, 8) != 0 ||
+            sb.version != IMAGE_VERSION ||
+            sb.blockSize < MIN_BLOCK_SIZE || sb.blockSize > MAX_BLOCK_SIZE ||
+            sb.imageSize > (uint64_t)st.st_size) {
+            printf("%s: not a VFS image.\n", path);
+            return -1;
+        }
+    }
+
+    if (map_regions(imageFd, &sb) < 0) return -1;
+    if (fresh) {
+        format_image(&sb);
+        if (pwrite(imageFd, imageBase, metaSize, 0) != (ssize_t)metaSize) {
+            perror(path);
+            return -1;
+        }
+        fdatasync(imageFd);
+    } else {
+        attach_image();
+    }
+
+    journalFd = jfd;
+    pageDirty = calloc(metaSize / IMAGE_ALIGN, 1);
+    dirtyPages = malloc(sizeof(uint32_t) * (metaSize / IMAGE_ALIGN));
+    if (!(super->features & FEATURE_DIR_TOTALS)) rebuild_dir_totals();
+    return 0;
+}
+
+void sync_image() {
+    journal_commit();
+}
+
+// Called once no command can run any more
+void close_image() {
+    if (journalFd >= 0) {
+        journal_commit_locked();
+        fdatasync(imageFd);
+        if (ftruncate(journalFd, 0) != 0) perror("journal");
+        close(journalFd);
+        journalFd = -1;
+    }
+    munmap(imageBase, metaSize);
+    munmap(diskMemory, dataSize);
+    if (imageFd >= 0) close(imageFd);
+    imageBase = diskMemory = NULL;
+    imageFd = -1;
+    free(pageDirty);
+    free(dirtyPages);
+    free(pendingFree);
+    free_dedup();
+}
+
+/* ------------------------ Block cache ------------------------ */
+
+void init_block_cache() {
+    cacheFrames = 0;
+    raWindow = RA_WINDOW;
+    if (imageFd < 0) return;
+    frameBytes = blockSize > IMAGE_ALIGN ? blockSize : IMAGE_ALIGN;
+    frameBlocks = frameBytes / blockSize;
+    if (cacheSize < 1) cacheSize = 1;
+    cacheFrames = (int)((cacheSize + frameBlocks - 1) / frameBlocks);
+    cacheShardCount = cacheFrames / (4 * CACHE_STRIPE);
+    if (cacheShardCount < 1) cacheShardCount = 1;
+    if (cacheShardCount > CACHE_SHARDS) cacheShardCount = CACHE_SHARDS;
+
+    for (int k = 0; k < cacheShardCount; k++) {
+        CacheShard *sh = &cacheShards[k];
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->frames = cacheFrames / cacheShardCount + (k < cacheFrames % cacheShardCount);
+        sh->slots = malloc(sizeof(CacheSlot) * sh->frames);
+        for (int i = 0; i < sh->frames; i++) {
+            sh->slots[i].frame = NO_BLOCK;
+            sh->slots[i].ref = sh->slots[i].dirty = 0;
+        }
+        sh->mapSize = 16;
+        while (sh->mapSize < sh->frames * 2) sh->mapSize *= 2;
+        sh->map = malloc(sizeof(CacheMapEntry) * sh->mapSize);
+        for (int i = 0; i < sh->mapSize; i++) sh->map[i].frame = NO_BLOCK;
+        sh->clockHand = 0;
+        sh->hits = sh->misses = sh->readahead = sh->writebacks = 0;
+    }
+
+    // a window the cache can't hold would evict itself before use
+    uint64_t shardBlocks = (uint64_t)(cacheFrames / cacheShardCount) * frameBlocks;
+    raWindow = shardBlocks / 4 < RA_WINDOW ? shardBlocks / 4 : RA_WINDOW;
+    if (raWindow < 1) raWindow = 1;
+}
+
+void free_block_cache() {
+    if (!cacheFrames) return;
+    for (int k = 0; k < cacheShardCount; k++) {
+        free(cacheShards[k].slots);
+        free(cacheShards[k].map);
+        pthread_mutex_destroy(&cacheShards[k].lock);
+    }
+    cacheFrames = 0;
+}
+
+CacheShard *cache_shard(blk_t fr) {
+    uint64_t h = (fr / CACHE_STRIPE) * 0x9E3779B97F4A7C15ULL;
+    return &cacheShards[(h >> 40) % cacheShardCount];
+}
+
+int cache_hash(const CacheShard *sh, blk_t fr) {
+    fr *= 0x9E3779B97F4A7C15ULL;
+    return (int)(fr >> 32) & (sh->mapSize - 1);
+}
+
+int cache_lookup(CacheShard *sh, blk_t fr) {
+    for (int i = cache_hash(sh, fr); sh->map[i].frame != NO_BLOCK; i = (i + 1) & (sh->mapSize - 1))
+        if (sh->map[i].frame == fr) return sh->map[i].slot;
+    return -1;
+}
+
+void cache_map_put(CacheShard *sh, blk_t fr, int slot) {
+    int i = cache_hash(sh, fr);
+    while (sh->map[i].frame != NO_BLOCK) i = (i + 1) & (sh->mapSize - 1);
+    sh->map[i].frame = fr;
+    sh->map[i].slot = slot;
+}
+
+// Linear-probing delete: shift later entries of the cluster back
+void cache_map_del(CacheShard *sh, blk_t fr) {
+    int mask = sh->mapSize - 1;
+    int i = cache_hash(sh, fr);
+    while (sh->map[i].frame != fr) i = (i + 1) & mask;
+    sh->map[i].frame = NO_BLOCK;
+
+    for (int j = (i + 1) & mask; sh->map[j].frame != NO_BLOCK; j = (j + 1) & mask) {
+        int home = cache_hash(sh, sh->map[j].frame);
+        // move j into the hole unless its home lies cyclically in (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            sh->map[i] = sh->map[j];
+            sh->map[j].frame = NO_BLOCK;
+            i = j;
+        }
+    }
+}
+
+// Give up a frame's residency: start writeback if it is dirty, unmap it
+// and let the kernel discard the page once clean. Safe while another
+// thread is using the frame: the mapping is shared, so an access just
+// faults it back in.
+void drop_frame(blk_t fr, int dirty) {
+    unsigned char *p = diskMemory + fr * frameBytes;
+    if (dirty) msync(p, frameBytes, MS_ASYNC);
+    madvise(p, frameBytes, MADV_DONTNEED);
+    posix_fadvise(imageFd, (off_t)(super->dataOff + fr * frameBytes), (off_t)frameBytes, POSIX_FADV_DONTNEED);
+}
+
+// CLOCK: sweep past referenced slots, clearing their bit
+int cache_evict(CacheShard *sh) {
+    while (1) {
+        CacheSlot *c = &sh->slots[sh->clockHand];
+        int slot = sh->clockHand;
+        sh->clockHand = (sh->clockHand + 1) % sh->frames;
+
+        if (c->frame != NO_BLOCK && c->ref) {
+            c->ref = 0;
+            continue;
+        }
+        if (c->frame != NO_BLOCK) {
+            drop_frame(c->frame, c->dirty);
+            if (c->dirty) sh->writebacks++;
+            cache_map_del(sh, c->frame);
+        }
+        return slot;
+    }
+}
+
+CacheSlot *cache_insert(CacheShard *sh, blk_t fr) {
+    int slot = cache_evict(sh);
+    CacheSlot *c = &sh->slots[slot];
+    c->frame = fr;
+    c->ref = 0;
+    c->dirty = 0;
+    cache_map_put(sh, fr, slot);
+    return c;
+}
+
+// Access a run of blocks through the cache; returns its data. A read
+// that misses asks for the missing frames in one request. The run takes
+// each shard's lock once per stripe it covers.
+unsigned char *cache_run(blk_t start, uint64_t len, int write) {
+    unsigned char *data = diskMemory + start * blockSize;
+    if (!cacheFrames || len == 0) return data;
+
+    blk_t first = start / frameBlocks, last = (start + len - 1) / frameBlocks;
+    blk_t missFirst = NO_BLOCK, missLast = 0;
+
+    for (blk_t fr = first; fr <= last; ) {
+        CacheShard *sh = cache_shard(fr);
+        blk_t stripeEnd = (fr / CACHE_STRIPE + 1) * CACHE_STRIPE;
+        pthread_mutex_lock(&sh->lock);
+        for (; fr <= last && fr < stripeEnd; fr++) {
+            CacheSlot *c;
+            int slot = cache_lookup(sh, fr);
+            if (slot >= 0) {
+                c = &sh->slots[slot];
+                sh->hits++;
+            } else {
+                c = cache_insert(sh, fr);
+                sh->misses++;
+                if (missFirst == NO_BLOCK) missFirst = fr;
+                missLast = fr;
+            }
+            c->ref = 1;
+            if (write) c->dirty = 1;
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    if (!write && missFirst != NO_BLOCK)
+        madvise(diskMemory + missFirst * frameBytes, (missLast - missFirst + 1) * frameBytes, MADV_WILLNEED);
+    return data;
+}
+
+// Prefetch a physical run: one madvise, and its frames enter the cache
+// unreferenced
+void cache_readahead(blk_t start, uint64_t len) {
+    if (!cacheFrames || len == 0) return;
+    blk_t first = start / frameBlocks, last = (start + len - 1) / frameBlocks;
+    madvise(diskMemory + first * frameBytes, (last - first + 1) * frameBytes, MADV_WILLNEED);
+
+    for (blk_t fr = first; fr <= last; ) {
+        CacheShard *sh = cache_shard(fr);
+        blk_t stripeEnd = (fr / CACHE_STRIPE + 1) * CACHE_STRIPE;
+        pthread_mutex_lock(&sh->lock);
+        for (; fr <= last && fr < stripeEnd; fr++) {
+            if (cache_lookup(sh, fr) >= 0) continue;
+            cache_insert(sh, fr);
+            sh->readahead++;
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+/* ------------------------ Query indexes ------------------------ */
+
+/* Secondary indexes for query: files by size, nodes by mtime and xattrs
+ * by "name=value". Each is a treap ordered by (string, key, inode) whose
+ * nodes count their subtree, so a range is counted in O(log n) and
+ * listed in O(log n + matches). They are in memory only: one pass over
+ * the inode table builds them on the first query, and from then on every
+ * change to a size, mtime or xattr updates them under indexLock. A change
+ * stores the new value first and only then updates the index, so a build
+ * racing with it either reads the new value or finishes before the
+ * update; inserts of an entry already present and removals of one that
+ * is missing are no-ops, so both orders end with the new value indexed. */
+typedef struct IndexNode {
+    uint64_t key;
+    char *str;                 // xattr index only
+    uint32_t ino;
+    uint32_t prio;
+    uint64_t count;            // entries in this subtree
+    struct IndexNode *left, *right;
+} IndexNode;
+
+typedef struct {
+    const char *str;
+    uint64_t key;
+    uint32_t ino;
+} IndexKey;
+
+IndexNode *sizeIndex = NULL, *mtimeIndex = NULL, *xattrIndex = NULL;
+int indexReady = 0;
+uint32_t indexSeed = 2463534242u;
+pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+
+int index_cmp(const IndexKey *k, const IndexNode *n) {
+    if (k->str) {
+        int c = strcmp(k->str, n->str);
+        if (c) return c;
+    }
+    if (k->key != n->key) return k->key < n->key ? -1 : 1;
+    return k->ino < n->ino ? -1 : k->ino > n->ino;
+}
+
+uint64_t index_count(const IndexNode *n) {
+    return n ? n->count : 0;
+}
+
+void index_fix(IndexNode *n) {
+    n->count = 1 + index_count(n->left) + index_count(n->right);
+}
+
+IndexNode *index_rotate_right(IndexNode *n) {
+    IndexNode *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    index_fix(n);
+    index_fix(l);
+    return l;
+}
+
+IndexNode *index_rotate_left(IndexNode *n) {
+    IndexNode *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    index_fix(n);
+    index_fix(r);
+    return r;
+}
+
+IndexNode *index_insert_node(IndexNode *n, IndexNode *x) {
+    if (!n) return x;
+    int c = index_cmp(&(IndexKey){ x->str, x->key, x->ino }, n);
+    if (c == 0) {
+        free(x->str);
+        free(x);
+        return n;
+    }
+    if (c < 0) {
+        n->left = index_insert_node(n->left, x);
+        if (n->left->prio > n->prio) return index_rotate_right(n);
+    } else {
+        n->right = index_insert_node(n->right, x);
+        if (n->right->prio > n->prio) return index_rotate_left(n);
+    }
+    index_fix(n);
+    return n;
+}
+
+// Join two treaps where everything in a sorts before everything in b
+IndexNode *index_merge(IndexNode *a, IndexNode *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->prio > b->prio) {
+        a->right = index_merge(a->right, b);
+        index_fix(a);
+        return a;
+    }
+    b->left = index_merge(a, b->left);
+    index_fix(b);
+    return b;
+}
+
+IndexNode *index_remove_node(IndexNode *n, const IndexKey *k) {
+    if (!n) return NULL;
+    int c = index_cmp(k, n);
+    if (c == 0) {
+        IndexNode *rest = index_merge(n->left, n->right);
+        free(n->str);
+        free(n);
+        return rest;
+    }
+    if (c < 0) n->left = index_remove_node(n->left, k);
+    else n->right = index_remove_node(n->right, k);
+    index_fix(n);
+    return n;
+}
+
+// Callers hold indexLock
+void index_add(IndexNode **root, const char *str, uint64_t key, uint32_t ino) {
+    IndexNode *x = malloc(sizeof(IndexNode));
+    indexSeed ^= indexSeed << 13;
+    indexSeed ^= indexSeed >> 17;
+    indexSeed ^= indexSeed << 5;
+    x->key = key;
+    x->str = str ? strdup(str) : NULL;
+    x->ino = ino;
+    x->prio = indexSeed;
+    x->count = 1;
+    x->left = x->right = NULL;
+    *root = index_insert_node(*root, x);
+}
+
+void index_del(IndexNode **root, const char *str, uint64_t key, uint32_t ino) {
+    *root = index_remove_node(*root, &(IndexKey){ str, key, ino });
+}
+
+// Entries sorting before k
+uint64_t index_rank(const IndexNode *n, const IndexKey *k) {
+    uint64_t r = 0;
+    while (n) {
+        if (index_cmp(k, n) <= 0) {
+            n = n->left;
+        } else {
+            r += index_count(n->left) + 1;
+            n = n->right;
+        }
+    }
+    return r;
+}
+
+// Inodes of the entries in [lo, hi), in index order
+void index_collect(const IndexNode *n, const IndexKey *lo, const IndexKey *hi, uint32_t *out, uint64_t *k) {
+    if (!n) return;
+    int aboveLo = index_cmp(lo, n) <= 0, belowHi = index_cmp(hi, n) > 0;
+    if (aboveLo) index_collect(n->left, lo, hi, out, k);
+    if (aboveLo && belowHi) out[(*k)++] = n->ino;
+    if (belowHi) index_collect(n->right, lo, hi, out, k);
+}
+
+void index_free(IndexNode *n) {
+    while (n) {
+        index_free(n->left);
+        IndexNode *r = n->right;
+        free(n->str);
+        free(n);
+        n = r;
+    }
+}
+
+/* ------------------------ Attributes ------------------------ */
+
+/* mtime and user xattrs, kept in the attribute table beside the inode
+ * table so older images keep their inode layout (they simply have no
+ * attributes). An xattr change writes a whole new block and frees the
+ * old one with the transaction, the way block maps are replaced. */
+
+// A size change of a file, for the size index
+void attr_size_changed(uint32_t ino, uint64_t oldBytes, uint64_t newBytes) {
+    if (!inodeAttrs || oldBytes == newBytes) return;
+    pthread_mutex_lock(&indexLock);
+    if (indexReady) {
+        index_del(&sizeIndex, NULL, oldBytes, ino);
+        index_add(&sizeIndex, NULL, newBytes, ino);
+    }
+    pthread_mutex_unlock(&indexLock);
+}
+
+// Set a file's size in its inode, then in the size index
+void store_content_bytes(uint32_t ino, DiskInode *d, uint64_t bytes) {
+    uint64_t old = d->contentBytes;
+    __atomic_store_n(&d->contentBytes, bytes, __ATOMIC_RELAXED);
+    attr_size_changed(ino, old, bytes);
+}
+
+void set_mtime(uint32_t ino, int64_t t) {
+    InodeAttr *a = &inodeAttrs[ino];
+    int64_t old = __atomic_exchange_n(&a->mtime, t, __ATOMIC_RELAXED);
+    if (old == t) return;
+    mark_dirty(a, sizeof(*a));
+    pthread_mutex_lock(&indexLock);
+    if (indexReady) {
+        index_del(&mtimeIndex, NULL, (uint64_t)old, ino);
+        index_add(&mtimeIndex, NULL, (uint64_t)t, ino);
+    }
+    pthread_mutex_unlock(&indexLock);
+}
+
+// The contents of a file, or the entries of a directory, changed now
+void touch_inode(uint32_t ino) {
+    if (inodeAttrs) set_mtime(ino, time(NULL));
+}
+
+unsigned char *xattr_data(const InodeAttr *a) {
+    return a->xattrLen ? block_data(a->xattrBlock) : NULL;
+}
+
+// Walk the entries of an xattr block: *off is advanced past the entry,
+// its name and value are copied out (NUL-terminated). 0 at the end.
+int xattr_next(const InodeAttr *a, uint32_t *off, char *name, char *value) {
+    if (*off >= a->xattrLen) return 0;
+    const unsigned char *p = xattr_data(a) + *off;
+    memcpy(name, p + 2, p[0]);
+    name[p[0]] = '\0';
+    memcpy(value, p + 2 + p[0], p[1]);
+    value[p[1]] = '\0';
+    *off += 2 + p[0] + p[1];
+    return 1;
+}
+
+// Value of xattr 'name' into value; -1 if the inode has none
+int get_xattr(uint32_t ino, const char *name, char *value) {
+    const InodeAttr *a = &inodeAttrs[ino];
+    char n[ATTR_NAME_MAX+1];
+    uint32_t off = 0;
+    while (xattr_next(a, &off, n, value))
+        if (strcmp(n, name) == 0) return 0;
+    return -1;
+}
+
+void index_xattr(uint32_t ino, const char *name, const char *value, int add) {
+    char key[ATTR_NAME_MAX + ATTR_VALUE_MAX + 2];
+    snprintf(key, sizeof(key), "%s=%s", name, value);
+    if (add) index_add(&xattrIndex, key, 0, ino);
+    else index_del(&xattrIndex, key, 0, ino);
+}
+
+// Replace an inode's xattr block with 'len' bytes of entries (count of
+// them). Returns -1 if no block is free; the old block stays.
+int store_xattrs(uint32_t ino, const unsigned char *buf, uint32_t len, uint32_t count) {
+    InodeAttr *a = &inodeAttrs[ino];
+    blk_t b = NO_BLOCK;
+    if (len) {
+        if ((b = pop_free_block()) == NO_BLOCK) return -1;
+        unsigned char *dst = block_data(b);
+        memcpy(dst, buf, len);
+        memset(dst + len, 0, blockSize - len);
+    }
+    if (a->xattrLen) queue_free_run(a->xattrBlock, 1);
+    mark_dirty(a, sizeof(*a));
+    a->xattrBlock = b;
+    a->xattrLen = len;
+    a->xattrCount = count;
+    return 0;
+}
+
+// Set (value != NULL) or remove an xattr. Returns 0, -1 if the disk is
+// full, -2 if the entries would not fit in a block, -3 if removing a
+// name the inode doesn't have.
+int update_xattr(uint32_t ino, const char *name, const char *value) {
+    InodeAttr *a = &inodeAttrs[ino];
+    unsigned char *buf = malloc(blockSize);
+    char n[ATTR_NAME_MAX+1], v[ATTR_VALUE_MAX+1], old[ATTR_VALUE_MAX+1];
+    uint32_t off = 0, len = 0, count = 0;
+    int found = 0;
+
+    while (xattr_next(a, &off, n, v)) {
+        if (strcmp(n, name) == 0) {
+            found = 1;
+            strcpy(old, v);
+            continue;
+        }
+        size_t nl = strlen(n), vl = strlen(v);
+        buf[len] = nl;
+        buf[len + 1] = vl;
+        memcpy(buf + len + 2, n, nl);
+        memcpy(buf + len + 2 + nl, v, vl);
+        len += 2 + nl + vl;
+        count++;
+    }
+    if (!value && !found) {
+        free(buf);
+        return -3;
+    }
+    if (value) {
+        size_t nl = strlen(name), vl = strlen(value);
+        if (len + 2 + nl + vl > blockSize) {
+            free(buf);
+            return -2;
+        }
+        buf[len] = nl;
+        buf[len + 1] = vl;
+        memcpy(buf + len + 2, name, nl);
+        memcpy(buf + len + 2 + nl, value, vl);
+        len += 2 + nl + vl;
+        count++;
+    }
+
+    int r = store_xattrs(ino, buf, len, count);
+    free(buf);
+    if (r < 0) return r;
+    pthread_mutex_lock(&indexLock);
+    if (indexReady) {
+        if (found) index_xattr(ino, name, old, 0);
+        if (value) index_xattr(ino, name, value, 1);
+    }
+    pthread_mutex_unlock(&indexLock);
+    return 0;
+}
+
+// A new inode: modified now, size 0, no xattrs
+void attr_init(uint32_t ino, int isDir) {
+    if (!inodeAttrs) return;
+    InodeAttr *a = &inodeAttrs[ino];
+    mark_dirty(a, sizeof(*a));
+    memset(a, 0, sizeof(*a));
+    a->mtime = time(NULL);
+    pthread_mutex_lock(&indexLock);
+    if (indexReady) {
+        if (!isDir) index_add(&sizeIndex, NULL, 0, ino);
+        index_add(&mtimeIndex, NULL, (uint64_t)a->mtime, ino);
+    }
+    pthread_mutex_unlock(&indexLock);
+}
+
+// An inode being freed leaves the indexes and gives up its xattr block
+void attr_release(uint32_t ino) {
+    if (!inodeAttrs) return;
+    InodeAttr *a = &inodeAttrs[ino];
+    const DiskInode *d = &inodeTable[ino];
+    pthread_mutex_lock(&indexLock);
+    if (indexReady) {
+        char n[ATTR_NAME_MAX+1], v[ATTR_VALUE_MAX+1];
+        uint32_t off = 0;
+        while (xattr_next(a, &off, n, v)) index_xattr(ino, n, v, 0);
+        if (!(d->flags & INODE_DIR)) index_del(&sizeIndex, NULL, d->contentBytes, ino);
+        index_del(&mtimeIndex, NULL, (uint64_t)a->mtime, ino);
+    }
+    pthread_mutex_unlock(&indexLock);
+    store_xattrs(ino, NULL, 0, 0);
+    a->mtime = 0;
+}
+
+// Give a copy its source's xattrs (and, for a file, its mtime).
+// Returns -1 if no block is free for them.
+int clone_attrs(uint32_t src, uint32_t dst) {
+    if (!inodeAttrs) return 0;
+    const InodeAttr *a = &inodeAttrs[src];
+    if (!(inodeTable[src].flags & INODE_DIR)) set_mtime(dst, a->mtime);
+    if (!a->xattrLen) return 0;
+    if (store_xattrs(dst, xattr_data(a), a->xattrLen, a->xattrCount) < 0) return -1;
+
+    pthread_mutex_lock(&indexLock);
+    if (indexReady) {
+        char n[ATTR_NAME_MAX+1], v[ATTR_VALUE_MAX+1];
+        uint32_t off = 0;
+        while (xattr_next(a, &off, n, v)) index_xattr(dst, n, v, 1);
+    }
+    pthread_mutex_unlock(&indexLock);
+    return 0;
+}
+
+// One pass over the inode table; afterwards the indexes are maintained
+void build_indexes() {
+    pthread_mutex_lock(&indexLock);
+    if (!indexReady) {
+        char n[ATTR_NAME_MAX+1], v[ATTR_VALUE_MAX+1];
+        for (uint32_t i = 0; i < super->inodeCount; i++) {
+            const DiskInode *d = &inodeTable[i];
+            if (!(d->flags & INODE_USED)) continue;
+            const InodeAttr *a = &inodeAttrs[i];
+            if (!(d->flags & INODE_DIR))
+                index_add(&sizeIndex, NULL, __atomic_load_n(&d->contentBytes, __ATOMIC_RELAXED), i);
+            index_add(&mtimeIndex, NULL, (uint64_t)__atomic_load_n(&a->mtime, __ATOMIC_RELAXED), i);
+            uint32_t off = 0;
+            while (xattr_next(a, &off, n, v)) index_xattr(i, n, v, 1);
+        }
+        indexReady = 1;
+    }
+    pthread_mutex_unlock(&indexLock);
+}
+
+void free_indexes() {
+    index_free(sizeIndex);
+    index_free(mtimeIndex);
+    index_free(xattrIndex);
+    sizeIndex = mtimeIndex = xattrIndex = NULL;
+    indexReady = 0;
+}
+
+/* ------------------------ Inode table ------------------------ */
+
+// Inode about to be modified: marks its page dirty for the journal
+DiskInode *inode_w(uint32_t ino) {
+    mark_dirty(&inodeTable[ino], sizeof(DiskInode));
+    return &inodeTable[ino];
+}
+
+uint32_t alloc_inode(const char *name, int isDir) {
+    if (super->freeInodes == 0) return NO_INODE;
+
+    for (uint32_t n = 0; n < super->inodeCount; n++) {
+        uint32_t i = (super->inodeHint + n) % super->inodeCount;
+        if (inodeTable[i].flags & INODE_USED) continue;
+
+        DiskInode *d = inode_w(i);
+        memset(d, 0, sizeof(*d));
+        d->flags = INODE_USED | (isDir ? INODE_DIR : 0);
+        d->parent = d->firstChild = NO_INODE;
+        d->nextSibling = d->prevSibling = NO_INODE;
+        d->mapBlock = NO_BLOCK;
+        strncpy(d->name, name, MAX_NAME);
+        attr_init(i, isDir);
+
+        super->freeInodes--;
+        super->inodeHint = i + 1;
+        mark_dirty(super, sizeof(*super));
+        return i;
+    }
+    return NO_INODE;
+}
+
+void free_inode(uint32_t ino) {
+    attr_release(ino);
+    inode_w(ino)->flags = 0;
+    super->freeInodes++;
+    mark_dirty(super, sizeof(*super));
+}
+
+// Append child to the tail of parent's on-disk child list
+void inode_link(uint32_t parent, uint32_t child) {
+    DiskInode *p = inode_w(parent);
+    DiskInode *c = inode_w(child);
+    c->parent = parent;
+    touch_inode(parent);
+
+    if (p->firstChild == NO_INODE) {
+        p->firstChild = child;
+        c->nextSibling = c->prevSibling = child;
+    } else {
+        uint32_t first = p->firstChild;
+        uint32_t last = inodeTable[first].prevSibling;
+        inode_w(last)->nextSibling = child;
+        c->prevSibling = last;
+        c->nextSibling = first;
+        inode_w(first)->prevSibling = child;
+    }
+}
+
+void inode_unlink(uint32_t child) {
+    DiskInode *c = inode_w(child);
+    DiskInode *p = inode_w(c->parent);
+    touch_inode(c->parent);
+
+    if (c->nextSibling == child) {
+        p->firstChild = NO_INODE;
+    } else {
+        inode_w(c->prevSibling)->nextSibling = c->nextSibling;
+        inode_w(c->nextSibling)->prevSibling = c->prevSibling;
+        if (p->firstChild == child)
+            p->firstChild = c->nextSibling;
+    }
+    c->parent = c->nextSibling = c->prevSibling = NO_INODE;
+}
+
+// Apply a change in a file's size to the totals of every directory
+// above it. Writers of different files may meet on a shared ancestor.
+void account_tree(uint32_t ino, int64_t bytes, int64_t blocks) {
+    if (!bytes && !blocks) return;
+    for (uint32_t p = inodeTable[ino].parent; p != NO_INODE; p = inodeTable[p].parent) {
+        DiskInode *d = inode_w(p);
+        __atomic_add_fetch(&d->contentBytes, bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&d->blockCount, blocks, __ATOMIC_RELAXED);
+    }
+}
+
+// Images made before directory totals get them once, at mount
+void rebuild_dir_totals() {
+    for (uint32_t i = 0; i < super->inodeCount; i++) {
+        if ((inodeTable[i].flags & (INODE_USED | INODE_DIR)) != (INODE_USED | INODE_DIR)) continue;
+        DiskInode *d = inode_w(i);
+        d->contentBytes = d->blockCount = 0;
+    }
+    for (uint32_t i = 0; i < super->inodeCount; i++) {
+        DiskInode *d = &inodeTable[i];
+        if ((d->flags & (INODE_USED | INODE_DIR)) == INODE_USED)
+            account_tree(i, d->contentBytes, d->blockCount);
+    }
+    super->features |= FEATURE_DIR_TOTALS;
+    mark_dirty(super, sizeof(*super));
+}
+
+MapBlock *map_block(blk_t b) {
+    return (MapBlock *)(diskMemory + b * blockSize);
+}
+
+void free_map_chain(DiskInode *d) {
+    blk_t b = d->mapBlock;
+    while (b != NO_BLOCK) {
+        blk_t nx = map_block(b)->next;
+        push_free_block(b);
+        b = nx;
+    }
+    d->mapBlock = NO_BLOCK;
+}
+
+/* ------------------------ Node slabs ------------------------ */
+
+/* FSNodes come from slabs of NODE_SLAB and go back to a free list, so
+ * create storms don't go through malloc and a directory's nodes sit
+ * close together. Names are interned in an arena, each distinct name
+ * stored once with a count of the nodes using it. When the last of them
+ * is freed the entry goes on a free list for the next name of its size,
+ * so a long-running server that churns through names reuses the space
+ * instead of growing. Unmount drops slabs and arena wholesale.
+ * Allocation is rare next to lookups, so one lock covers it all. */
+#define NODE_SLAB       1024
+#define NAME_CHUNK      (64 << 10)
+#define NAME_TABLE_INIT 1024
+
+typedef struct NodeSlab {
+    struct NodeSlab *next;
+    int used;
+    FSNode nodes[NODE_SLAB];
+} NodeSlab;
+
+typedef struct NameChunk {
+    struct NameChunk *next;
+    size_t used;
+    char data[NAME_CHUNK];
+} NameChunk;
+
+// An interned name in the arena, 8-byte aligned. A free entry keeps its
+// next-free link where the string was.
+typedef struct NameEntry {
+    uint32_t refs;             // nodes using the name
+    uint32_t size;             // bytes for the string, a multiple of 8
+    char name[];
+} NameEntry;
+
+#define NAME_CLASSES ((MAX_NAME + 8) / 8 + 1)
+
+NodeSlab *nodeSlabs = NULL;
+FSNode *freeNodes = NULL;          // chained through hashNext
+long long nodesLive = 0, slabCount = 0;
+NameChunk *nameChunks = NULL;
+NameEntry *freeNames[NAME_CLASSES];    // by size / 8
+const char **nameTable = NULL;     // open addressing, linear probing
+uint64_t nameTableSize = 0, nameCount = 0, nameBytes = 0;
+pthread_mutex_t slabLock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned int name_hash(const char *name);
+
+void name_table_grow() {
+    const char **old = nameTable;
+    uint64_t oldSize = nameTableSize;
+    nameTableSize = oldSize ? oldSize * 2 : NAME_TABLE_INIT;
+    nameTable = calloc(nameTableSize, sizeof(char *));
+    for (uint64_t i = 0; i < oldSize; i++) {
+        if (!old[i]) continue;
+        uint64_t j = name_hash(old[i]) & (nameTableSize - 1);
+        while (nameTable[j]) j = (j + 1) & (nameTableSize - 1);
+        nameTable[j] = old[i];
+    }
+    free(old);
+}
+
+NameEntry *name_entry(const char *name) {
+    return (NameEntry *)(name - offsetof(NameEntry, name));
+}
+
+// Take out a name, shifting later entries of its probe run back so
+// lookups never stop short at the hole
+void name_table_remove(const char *name) {
+    uint64_t mask = nameTableSize - 1, i = name_hash(name) & mask;
+    while (nameTable[i] != name) i = (i + 1) & mask;
+    nameTable[i] = NULL;
+    for (uint64_t j = (i + 1) & mask; nameTable[j]; j = (j + 1) & mask) {
+        uint64_t home = name_hash(nameTable[j]) & mask;
+        if (((j - home) & mask) < ((j - i) & mask)) continue;
+        nameTable[i] = nameTable[j];
+        nameTable[j] = NULL;
+        i = j;
+    }
+}
+
+// The interned copy of a name (cut to MAX_NAME), with one more
+// reference; caller holds slabLock
+const char *intern_name(const char *name) {
+    char buf[MAX_NAME+1];
+    strncpy(buf, name, MAX_NAME);
+    buf[MAX_NAME] = '\0';
+
+    if ((nameCount + 1) * 2 > nameTableSize) name_table_grow();
+    uint64_t mask = nameTableSize - 1, i = name_hash(buf) & mask;
+    for (; nameTable[i]; i = (i + 1) & mask) {
+        if (strcmp(nameTable[i], buf) == 0) {
+            name_entry(nameTable[i])->refs++;
+            return nameTable[i];
+        }
+    }
+
+    size_t len = strlen(buf) + 1;
+    uint32_t size = (len + 7) & ~(size_t)7;
+    NameEntry *e = freeNames[size / 8];
+    if (e) {
+        memcpy(&freeNames[size / 8], e->name, sizeof(NameEntry *));
+    } else {
+        size_t need = sizeof(NameEntry) + size;
+        if (!nameChunks || nameChunks->used + need > NAME_CHUNK) {
+            NameChunk *c = malloc(sizeof(NameChunk));
+            c->next = nameChunks;
+            c->used = 0;
+            nameChunks = c;
+        }
+        e = (NameEntry *)(nameChunks->data + nameChunks->used);
+        e->size = size;
+        nameChunks->used += need;
+    }
+    e->refs = 1;
+    memcpy(e->name, buf, len);
+    nameBytes += len;
+    nameTable[i] = e->name;
+    nameCount++;
+    return e->name;
+}
+
+// Drop a reference taken by intern_name; caller holds slabLock
+void release_name(const char *name) {
+    NameEntry *e = name_entry(name);
+    if (--e->refs > 0) return;
+    name_table_remove(name);
+    nameBytes -= strlen(name) + 1;
+    nameCount--;
+    memcpy(e->name, &freeNames[e->size / 8], sizeof(NameEntry *));
+    freeNames[e->size / 8] = e;
+}
+
+// A node slot with every field zero; caller holds slabLock
+FSNode *slab_alloc() {
+    FSNode *n = freeNodes;
+    if (n) {
+        freeNodes = n->hashNext;
+        memset(n, 0, sizeof(*n));
+    } else {
+        if (!nodeSlabs || nodeSlabs->used == NODE_SLAB) {
+            NodeSlab *sl = calloc(1, sizeof(NodeSlab));
+            sl->next = nodeSlabs;
+            nodeSlabs = sl;
+            slabCount++;
+        }
+        n = &nodeSlabs->nodes[nodeSlabs->used++];
+    }
+    nodesLive++;
+    return n;
+}
+
+// Unmount: all nodes and names at once. A node's side tables (extents,
+// name index, cached path) are its own allocations; freed nodes have
+// none, so the slabs are simply swept.
+void release_node_slabs() {
+    while (nodeSlabs) {
+        NodeSlab *sl = nodeSlabs;
+        for (int i = 0; i < sl->used; i++) {
+            free(sl->nodes[i].extents);
+            free(sl->nodes[i].childTable);
+            free(sl->nodes[i].path);
+        }
+        nodeSlabs = sl->next;
+        free(sl);
+    }
+    while (nameChunks) {
+        NameChunk *c = nameChunks;
+        nameChunks = c->next;
+        free(c);
+    }
+    memset(freeNames, 0, sizeof(freeNames));
+    free(nameTable);
+    nameTable = NULL;
+    nameTableSize = nameCount = nameBytes = 0;
+    freeNodes = NULL;
+    nodesLive = slabCount = 0;
+}
+
+/* ------------------------ File node helpers ------------------------ */
+
+FSNode *new_node(const char *name, int isDir) {
+    pthread_mutex_lock(&slabLock);
+    FSNode *n = slab_alloc();
+    n->name = intern_name(name);
+    pthread_mutex_unlock(&slabLock);
+
+    n->isDirectory = isDir;
+    n->parent = NULL;
+    n->child = NULL;
+    n->nextSibling = n->prevSibling = NULL;
+
+    n->childTable = NULL;
+    n->tableSize = 0;
+    n->childCount = 0;
+    n->hashNext = NULL;
+    n->path = NULL;
+    n->ino = NO_INODE;
+    n->loaded = 1;
+
+    n->extents = NULL;
+    n->extentCount = 0;
+    n->extentCap = 0;
+    n->blockCount = 0;
+    n->raNext = 0;
+    n->contentBytes = 0;
+    n->mapDirty = 0;
+    n->compressed = 0;
+    n->inlined = 0;
+
+    pthread_rwlock_init(&n->lock, NULL);
+    n->cwdRefs = 0;
+    return n;
+}
+
+/* ------------------------ Directory index ------------------------ */
+
+#define INDEX_INIT_SIZE 8
+
+// FNV-1a
+unsigned int name_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void index_grow(FSNode *dir) {
+    int newSize = dir->tableSize ? dir->tableSize * 2 : INDEX_INIT_SIZE;
+    FSNode **t = calloc(newSize, sizeof(FSNode *));
+
+    for (int i = 0; i < dir->tableSize; i++) {
+        FSNode *c = dir->childTable[i];
+        while (c) {
+            FSNode *nx = c->hashNext;
+            unsigned int b = name_hash(c->name) & (newSize - 1);
+            c->hashNext = t[b];
+            t[b] = c;
+            c = nx;
+        }
+    }
+    free(dir->childTable);
+    dir->childTable = t;
+    dir->tableSize = newSize;
+}
+
+void index_insert(FSNode *dir, FSNode *child) {
+    // keep load factor <= 1
+    if (dir->childCount + 1 > dir->tableSize) index_grow(dir);
+    unsigned int b = name_hash(child->name) & (dir->tableSize - 1);
+    child->hashNext = dir->childTable[b];
+    dir->childTable[b] = child;
+    dir->childCount++;
+}
+
+void index_remove(FSNode *dir, FSNode *child) {
+    if (!dir->childTable) return;
+    unsigned int b = name_hash(child->name) & (dir->tableSize - 1);
+    FSNode **pp = &dir->childTable[b];
+    while (*pp) {
+        if (*pp == child) {
+            *pp = child->hashNext;
+            child->hashNext = NULL;
+            dir->childCount--;
+            return;
+        }
+        pp = &(*pp)->hashNext;
+    }
+}
+
+FSNode *find_child(FSNode *dir, const char *name) {
+    COUNT(childLookups, 1);
+    if (!is_loaded(dir)) load_dir(dir);
+    if (!dir->childTable) return NULL;
+    FSNode *c = dir->childTable[name_hash(name) & (dir->tableSize - 1)];
+    while (c) {
+        if (strcmp(c->name, name) == 0) return c;
+        c = c->hashNext;
+    }
+    return NULL;
+}
+
+// Back to the slab. A file's extents must already be freed.
+void free_node(FSNode *n) {
+    pthread_rwlock_destroy(&n->lock);
+    free(n->childTable);
+    free(n->path);
+    n->extents = NULL;
+    n->childTable = NULL;
+    n->path = NULL;
+
+    pthread_mutex_lock(&slabLock);
+    release_name(n->name);
+    n->name = NULL;
+    n->hashNext = freeNodes;
+    freeNodes = n;
+    nodesLive--;
+    pthread_mutex_unlock(&slabLock);
+}
+
+/* ------------------------ Sibling list ------------------------ */
+
+// Children stay in a circular list in insertion order (used by ls);
+// the hash index above is kept in sync for lookups.
+void add_child(FSNode *parent, FSNode *child) {
+    child->parent = parent;
+    if (!parent->child) {
+        parent->child = child;
+        child->nextSibling = child->prevSibling = child;
+    } else {
+        FSNode *first = parent->child;
+        FSNode *last = first->prevSibling;
+        last->nextSibling = child;
+        child->prevSibling = last;
+        child->nextSibling = first;
+        first->prevSibling = child;
+    }
+    index_insert(parent, child);
+}
+
+// Remove from circular sibling list
+void detach_child(FSNode *parent, FSNode *child) {
+    if (!parent->child) return;
+
+    if (child->nextSibling == child && child->prevSibling == child) {
+        parent->child = NULL;
+    } else {
+        child->prevSibling->nextSibling = child->nextSibling;
+        child->nextSibling->prevSibling = child->prevSibling;
+        if (parent->child == child)
+            parent->child = child->nextSibling;
+    }
+    index_remove(parent, child);
+    dcacheGen++;
+    child->nextSibling = child->prevSibling = NULL;
+    child->parent = NULL;
+}
+
+/* ------------------------ Lazy tree loading ------------------------ */
+
+FSNode *node_from_inode(uint32_t ino) {
+    DiskInode *d = &inodeTable[ino];
+    FSNode *n = new_node(d->name, (d->flags & INODE_DIR) != 0);
+    n->ino = ino;
+    n->contentBytes = d->contentBytes;
+    n->blockCount = d->blockCount;
+    n->compressed = (d->flags & INODE_COMPRESSED) != 0;
+    n->inlined = (d->flags & INODE_INLINE) != 0;
+    n->loaded = 0;
+    return n;
+}
+
+// Several readers may reach an unloaded node at once: the first one
+// takes loadLock and fills it in, and 'loaded' is only published once
+// the node is complete.
+int is_loaded(FSNode *n) {
+    return __atomic_load_n(&n->loaded, __ATOMIC_ACQUIRE);
+}
+
+// Materialize a directory's children from its on-disk child list
+void load_dir(FSNode *dir) {
+    pthread_mutex_lock(&loadLock);
+    uint32_t first = inodeTable[dir->ino].firstChild;
+    if (!dir->loaded && first != NO_INODE) {
+        uint32_t c = first;
+        do {
+            add_child(dir, node_from_inode(c));
+            c = inodeTable[c].nextSibling;
+        } while (c != first);
+    }
+    __atomic_store_n(&dir->loaded, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&loadLock);
+}
+
+// Fill in a file's extents from its inode (inline, then the overflow chain)
+void read_file_map(FSNode *f) {
+    DiskInode *d = &inodeTable[f->ino];
+    if (d->extentCount == 0) return;
+    f->extents = malloc(sizeof(Extent) * d->extentCount);
+    f->extentCap = d->extentCount;
+
+    uint64_t logical = 0;
+    for (uint32_t e = 0; e < d->extentCount && e < INLINE_EXTENTS; e++) {
+        Extent *x = &f->extents[f->extentCount++];
+        x->logical = logical;
+        x->start = d->ext[e].start;
+        x->len = d->ext[e].len;
+        logical += x->len;
+    }
+    for (blk_t b = d->mapBlock; b != NO_BLOCK; b = map_block(b)->next) {
+        MapBlock *m = map_block(b);
+        for (uint32_t e = 0; e < m->count; e++) {
+            Extent *x = &f->extents[f->extentCount++];
+            x->logical = logical;
+            x->start = m->ext[e].start;
+            x->len = m->ext[e].len;
+            logical += x->len;
+        }
+    }
+    // a compressed file's extents are indexed by group instead
+    if (f->compressed)
+        for (int e = 0; e < f->extentCount; e++) f->extents[e].logical = e;
+}
+
+// Read a file's extents from its inode on first access
+void load_file_map(FSNode *f) {
+    if (is_loaded(f)) return;
+    pthread_mutex_lock(&loadLock);
+    if (!f->loaded) read_file_map(f);
+    __atomic_store_n(&f->loaded, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&loadLock);
+}
+
+// Write a file's size and extents back to its inode.
+// Returns -1 if there is no room for overflow map blocks.
+int store_file_map(FSNode *f) {
+    DiskInode *d = inode_w(f->ino);
+
+    // The new chain's blocks are allocated before the old chain is freed:
+    // with a journal the old blocks only become free at the next commit,
+    // and other sessions may take free blocks at any moment. A shortfall
+    // hands back what was taken (never referenced, so at once) and leaves
+    // the inode as it was.
+    int overflow = f->extentCount > INLINE_EXTENTS ? f->extentCount - INLINE_EXTENTS : 0;
+    uint64_t mapBlocks = (overflow + MAP_BLOCK_EXTENTS - 1) / MAP_BLOCK_EXTENTS;
+    blk_t *fresh = mapBlocks ? malloc(sizeof(blk_t) * mapBlocks) : NULL;
+    for (uint64_t i = 0; i < mapBlocks; i++) {
+        if ((fresh[i] = pop_free_block()) != NO_BLOCK) continue;
+        while (i > 0) clear_block_run(fresh[--i], 1);
+        free(fresh);
+        return -1;
+    }
+    free_map_chain(d);
+    f->mapDirty = 0;
+    account_tree(f->ino, (int64_t)(f->contentBytes - d->contentBytes), (int64_t)(f->blockCount - d->blockCount));
+
+    d->flags = f->compressed ? d->flags | INODE_COMPRESSED : d->flags & ~INODE_COMPRESSED;
+    d->flags = f->inlined ? d->flags | INODE_INLINE : d->flags & ~INODE_INLINE;
+    store_content_bytes(f->ino, d, f->contentBytes);
+    d->blockCount = f->blockCount;
+    d->extentCount = f->extentCount;
+
+    MapBlock *m = NULL;
+    blk_t *link = &d->mapBlock;
+    uint64_t used = 0;
+    for (int e = 0; e < f->extentCount; e++) {
+        DiskExtent x = { f->extents[e].start, f->extents[e].len };
+
+        if (e < INLINE_EXTENTS) {
+            d->ext[e] = x;
+        } else {
+            if (!m || m->count == (uint32_t)MAP_BLOCK_EXTENTS) {
+                blk_t b = fresh[used++];
+                *link = b;
+                m = map_block(b);
+                m->next = NO_BLOCK;
+                m->count = 0;
+                link = &m->next;
+            }
+            m->ext[m->count++] = x;
+        }
+    }
+    free(fresh);
+    return 0;
+}
+
+/* ------------------------ Subtree walks ------------------------ */
+
+/* Whole-subtree operations (rm -r, find, cp -r) walk with an
+ * explicit stack, so tree depth is bounded by memory, not the C stack. */
+typedef struct {
+    FSNode *node;
+    FSNode *dest;              // cp: the directory receiving node's copy
+} WalkItem;
+
+typedef struct {
+    WalkItem *items;
+    int count, cap;
+} WalkStack;
+
+void walk_push(WalkStack *w, FSNode *node, FSNode *dest) {
+    if (w->count == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 64;
+        w->items = realloc(w->items, sizeof(WalkItem) * w->cap);
+    }
+    w->items[w->count++] = (WalkItem){ node, dest };
+}
+
+int walk_pop(WalkStack *w, WalkItem *out) {
+    if (w->count == 0) return 0;
+    *out = w->items[--w->count];
+    return 1;
+}
+
+// Push a directory's children so that they pop in list order. An
+// unloaded directory is loaded first if 'load' is set, else skipped.
+void walk_children(WalkStack *w, FSNode *dir, FSNode *dest, int load) {
+    if (!is_loaded(dir)) {
+        if (!load) return;
+        load_dir(dir);
+    }
+    if (!dir->child) return;
+    FSNode *last = dir->child->prevSibling, *c = last;
+    do {
+        walk_push(w, c, dest);
+        c = c->prevSibling;
+    } while (c != last);
+}
+
+/* ------------------------ File extents ------------------------ */
+
+// Grow the extent array geometrically so repeated appends cost
+// amortized O(1)
+void reserve_extents(FSNode *f, int count) {
+    if (count <= f->extentCap) return;
+    int cap = f->extentCap ? f->extentCap : 4;
+    while (cap < count) cap *= 2;
+    f->extents = realloc(f->extents, sizeof(Extent) * cap);
+    f->extentCap = cap;
+}
+
+// Add a physical run at the end of the file, merging with the last
+// extent when the run continues it
+void extent_append(FSNode *f, blk_t start, uint64_t len) {
+    if (f->extentCount) {
+        Extent *last = &f->extents[f->extentCount - 1];
+        if (last->start + last->len == start) {
+            last->len += len;
+            f->blockCount += len;
+            return;
+        }
+    }
+    reserve_extents(f, f->extentCount + 1);
+    Extent *x = &f->extents[f->extentCount++];
+    x->logical = f->blockCount;
+    x->start = start;
+    x->len = len;
+    f->blockCount += len;
+}
+
+// Index of the extent holding logical block 'lb' (binary search)
+int find_extent(const FSNode *f, uint64_t lb) {
+    int lo = 0, hi = f->extentCount - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (f->extents[mid].logical <= lb) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Drop logical blocks from 'count' onwards, returning them to the allocator
+void truncate_extents(FSNode *f, uint64_t count) {
+    while (f->extentCount) {
+        Extent *x = &f->extents[f->extentCount - 1];
+        if (x->logical >= count) {
+            free_block_run(x->start, x->len);
+            f->extentCount--;
+        } else {
+            if (x->logical + x->len > count) {
+                uint64_t keep = count - x->logical;
+                free_block_run(x->start + keep, x->len - keep);
+                x->len = keep;
+            }
+            break;
+        }
+    }
+    f->blockCount = count;
+}
+
+// Allocate 'count' more blocks at the end of the file in contiguous runs,
+// zero-filled when 'zero' is set. Returns the number allocated, which is
+// short only if other sessions took the space first.
+uint64_t grow_file(FSNode *f, uint64_t count, int zero) {
+    uint64_t grown = 0;
+    while (grown < count) {
+        blk_t start = 0;
+        uint64_t run = alloc_block_run(count - grown, &start);
+        if (run == 0) break;
+        if (zero) memset(cache_run(start, run, 1), 0, run * blockSize);
+        extent_append(f, start, run);
+        grown += run;
+    }
+    return grown;
+}
+
+// Point logical block 'lb' at physical block 'phys', splitting its extent
+void extent_set_block(FSNode *f, uint64_t lb, blk_t phys) {
+    int e = find_extent(f, lb);
+    Extent old = f->extents[e];
+    uint64_t k = lb - old.logical;
+    if (old.start + k == phys) return;
+    f->mapDirty = 1;
+
+    int extra = (k > 0) + (k + 1 < old.len);
+    reserve_extents(f, f->extentCount + extra);
+    memmove(&f->extents[e + 1 + extra], &f->extents[e + 1], sizeof(Extent) * (f->extentCount - e - 1));
+    f->extentCount += extra;
+
+    if (k > 0) f->extents[e++] = (Extent){ old.logical, old.start, k };
+    f->extents[e++] = (Extent){ lb, phys, 1 };
+    if (k + 1 < old.len) f->extents[e] = (Extent){ lb + 1, old.start + k + 1, old.len - k - 1 };
+}
+
+// Merge neighbouring extents that are physically contiguous
+void coalesce_extents(FSNode *f) {
+    int out = 0;
+    for (int i = 0; i < f->extentCount; i++) {
+        Extent *prev = out ? &f->extents[out - 1] : NULL;
+        if (prev && prev->start + prev->len == f->extents[i].start) prev->len += f->extents[i].len;
+        else f->extents[out++] = f->extents[i];
+    }
+    f->extentCount = out;
+}
+
+// Before logical blocks [from, to) are modified in place: shared blocks
+// are replaced by private copies (copy-on-write), sole-owned ones leave
+// the index. Returns -1 if there is no room for a copy.
+int unshare_range(FSNode *f, uint64_t from, uint64_t to) {
+    if (!sharingEnabled || f->compressed) return 0;
+    int copied = 0;
+    for (uint64_t lb = from; lb < to; lb++) {
+        Extent *x = &f->extents[find_extent(f, lb)];
+        blk_t b = x->start + (lb - x->logical);
+
+        pthread_mutex_lock(&dedupLock);
+        int shared = blockShares[b] > 0;
+        if (!shared) dedup_forget(b);
+        pthread_mutex_unlock(&dedupLock);
+        if (!shared) continue;
+
+        // no early commit here: the inode still points at the shared block
+        blk_t copy;
+        if (!alloc_block_run(1, &copy)) return -1;
+        memcpy(cache_run(copy, 1, 1), block_data(b), blockSize);
+        extent_set_block(f, lb, copy);
+        drop_block_refs(b, 1);
+        copied = 1;
+    }
+    if (copied) coalesce_extents(f);
+    return 0;
+}
+
+// Share identical blocks: each block of logical [from, to) whose content
+// is already on disk elsewhere is remapped there and its own copy freed;
+// the rest are indexed. Returns the number of blocks remapped.
+uint64_t dedup_range(FSNode *f, uint64_t from, uint64_t to) {
+    if (!dedupEnabled || f->compressed) return 0;
+    uint64_t remapped = 0;
+
+    pthread_mutex_lock(&dedupLock);
+    for (uint64_t lb = from; lb < to; lb++) {
+        Extent *x = &f->extents[find_extent(f, lb)];
+        blk_t b = x->start + (lb - x->logical);
+        if (blockShares[b] || dedup_is_indexed(b)) continue;
+
+        uint64_t h = block_fingerprint(block_data(b));
+        DedupEntry *e = dedup_find(h);
+        if (e && memcmp(block_data(e->block), block_data(b), blockSize) == 0) {
+            set_shares(e->block, blockShares[e->block] + 1);
+            extent_set_block(f, lb, e->block);
+            drop_refs_locked(b, 1);
+            remapped++;
+        } else {
+            dedup_insert(h, b);
+        }
+    }
+    dedupHits += remapped;
+    pthread_mutex_unlock(&dedupLock);
+
+    if (remapped) coalesce_extents(f);
+    return remapped;
+}
+
+void release_file_data(FSNode *f) {
+    free_extents(f->extents, f->extentCount);
+    free(f->extents);
+    f->extents = NULL;
+    f->extentCount = f->extentCap = 0;
+    f->blockCount = 0;
+    f->contentBytes = 0;
+    f->inlined = 0;
+}
+
+/* ------------------------ Inline files ------------------------ */
+
+/* A file of up to INLINE_BYTES keeps its bytes in the inode, in the room
+ * its inline extents would take: no data block, no extent array, and the
+ * bytes are journaled with the rest of the inode. Writes pick the form:
+ * a small file stays inline, and one that grows past the limit has its
+ * bytes moved to a block first. Compressed files are never inline. */
+#define INLINE_BYTES ((uint64_t)sizeof(((DiskInode *)0)->ext))
+
+int ensure_free_blocks(uint64_t n);
+
+unsigned char *inline_bytes(uint32_t ino) {
+    return (unsigned char *)inodeTable[ino].ext;
+}
+
+// Can f hold its first 'end' bytes inline? Only a file that already is,
+// or one that has no blocks yet.
+int fits_inline(FSNode *f, uint64_t end) {
+    return !f->compressed && end <= INLINE_BYTES && (f->inlined || f->extentCount == 0);
+}
+
+// Write 'len' bytes at 'off' of a file that fits_inline; a gap before
+// 'off' reads as zeros
+void inline_write(FSNode *f, uint64_t off, const char *data, size_t len) {
+    DiskInode *d = inode_w(f->ino);
+    unsigned char *p = (unsigned char *)d->ext;
+    if (!f->inlined) {
+        f->inlined = 1;
+        d->flags |= INODE_INLINE;
+        d->extentCount = 0;
+        memset(p, 0, INLINE_BYTES);
+    }
+    if (off > f->contentBytes) memset(p + f->contentBytes, 0, off - f->contentBytes);
+    memcpy(p + off, data, len);
+    if (off + len > f->contentBytes) f->contentBytes = off + len;
+
+    account_tree(f->ino, (int64_t)(f->contentBytes - d->contentBytes), 0);
+    store_content_bytes(f->ino, d, f->contentBytes);
+}
+
+// Move an inline file's bytes into a block of its own, before a write
+// that needs the file in blocks. Returns -1 if the disk is full.
+int uninline_file(FSNode *f) {
+    if (!f->inlined) return 0;
+    unsigned char keep[INLINE_BYTES];
+    uint64_t bytes = f->contentBytes;
+    memcpy(keep, inline_bytes(f->ino), bytes);
+
+    if (bytes) {
+        blk_t b;
+        if (!ensure_free_blocks(1) || (b = pop_free_block()) == NO_BLOCK) return -1;
+        unsigned char *p = cache_run(b, 1, 1);
+        memcpy(p, keep, bytes);
+        memset(p + bytes, 0, blockSize - bytes);
+        extent_append(f, b, 1);
+    }
+    f->inlined = 0;
+    return store_file_map(f);          // the extent overwrites the bytes
+}
+
+/* ------------------------ Compressed files ------------------------ */
+
+/* A compressed file is cut into groups of GROUP_BLOCKS logical blocks,
+ * each packed on its own into a frame (header, then the packed bytes)
+ * that fills one contiguous run; extent g is the frame of group g.
+ * Frames are never changed in place: a write decodes the groups it
+ * touches, patches them and packs each into a new frame. Reads decode
+ * only the groups they cover. */
+#define GROUP_BLOCKS      16
+#define GROUP_BYTES       ((uint64_t)GROUP_BLOCKS * blockSize)
+#define FRAME_ALLOC_TRIES 32
+
+typedef struct {
+    uint32_t rawLen;           // bytes of file data in the group
+    uint32_t packedLen;        // payload bytes; == rawLen if stored as is
+} FrameHeader;
+
+long long groupsPacked = 0, groupsUnpacked = 0;   // updated atomically
+
+/* LZ codec, LZ4 block format: each sequence is a token (literal count,
+ * match length - 4), the literals, a 2-byte offset back into the output
+ * and the match. Counts of 15 continue in bytes of 255. The last
+ * sequence is literals only. */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_TAIL      12        // no match starts this close to the end
+#define LZ_LAST_LITS 5         // ...or ends this close
+
+uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// Continue a count of 15 or more; NULL if the output is full
+unsigned char *lz_put_len(unsigned char *op, unsigned char *end, uint64_t n) {
+    for (; n >= 255; n -= 255) {
+        if (op >= end) return NULL;
+        *op++ = 255;
+    }
+    if (op >= end) return NULL;
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+// Emit 'lit' literals from src, then a match of mlen bytes at 'off'
+// back (mlen 0: the final sequence). NULL if the output is full.
+unsigned char *lz_put_seq(unsigned char *op, unsigned char *end, const unsigned char *src,
+                          uint64_t lit, uint32_t off, uint64_t mlen) {
+    if (op >= end) return NULL;
+    unsigned char *token = op++;
+    *token = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15 && !(op = lz_put_len(op, end, lit - 15))) return NULL;
+    if ((uint64_t)(end - op) < lit) return NULL;
+    memcpy(op, src, lit);
+    op += lit;
+    if (mlen == 0) return op;
+
+    if (end - op < 2) return NULL;
+    *op++ = off & 0xFF;
+    *op++ = off >> 8;
+    uint64_t m = mlen - LZ_MIN_MATCH;
+    *token |= m >= 15 ? 15 : m;
+    if (m >= 15 && !(op = lz_put_len(op, end, m - 15))) return NULL;
+    return op;
+}
+
+// Pack n bytes into dst. Returns the packed size, or 0 if it does not
+// fit in cap bytes.
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];   // last position + 1 seen per hash
+    memset(table, 0, sizeof(table));
+    unsigned char *op = dst, *end = dst + cap;
+    size_t ip = 0, anchor = 0;
+
+    while (n > LZ_TAIL && ip < n - LZ_TAIL) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        table[h] = ip + 1;
+        if (!ref || ip - (ref - 1) > 65535 || read32(src + ref - 1) != seq) {
+            ip += 1 + ((ip - anchor) >> 6);   // speed up through incompressible data
+            continue;
+        }
+        ref--;
+        size_t mlen = LZ_MIN_MATCH;
+        while (ip + mlen < n - LZ_LAST_LITS && src[ref + mlen] == src[ip + mlen]) mlen++;
+
+        if (!(op = lz_put_seq(op, end, src + anchor, ip - anchor, ip - ref, mlen))) return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+    if (!(op = lz_put_seq(op, end, src + anchor, n - anchor, 0, 0))) return 0;
+    return op - dst;
+}
+
+int lz_get_len(const unsigned char **ip, const unsigned char *iend, uint64_t *n) {
+    unsigned char b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Unpack into dst. Returns the unpacked size, or -1 if the input is
+// malformed or would overflow cap bytes.
+long lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        uint64_t lit = token >> 4;
+        if (lit == 15 && lz_get_len(&ip, iend, &lit) < 0) return -1;
+        if ((uint64_t)(iend - ip) < lit || (uint64_t)(oend - op) < lit) return -1;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        uint64_t mlen = token & 15;
+        if (mlen == 15 && lz_get_len(&ip, iend, &mlen) < 0) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - dst) || (uint64_t)(oend - op) < mlen) return -1;
+
+        const unsigned char *m = op - off;
+        if (off >= mlen) {
+            memcpy(op, m, mlen);
+            op += mlen;
+        } else {
+            while (mlen--) *op++ = *m++;   // overlaps its own output
+        }
+    }
+    return op - dst;
+}
+
+// Decode a frame into raw (GROUP_BYTES), zero-filled past its data.
+// Returns the group's length; a damaged frame reads as zeros (-1).
+long decode_frame(const Extent *x, unsigned char *raw) {
+    const unsigned char *p = cache_run(x->start, x->len, 0);
+    FrameHeader h;
+    memcpy(&h, p, sizeof(h));
+    long n = -1;
+    if (h.rawLen <= GROUP_BYTES && sizeof(h) + h.packedLen <= x->len * blockSize) {
+        if (h.packedLen == h.rawLen) {
+            memcpy(raw, p + sizeof(h), h.rawLen);
+            n = h.rawLen;
+        } else if (lz_decompress(p + sizeof(h), h.packedLen, raw, h.rawLen) == h.rawLen) {
+            n = h.rawLen;
+        }
+    }
+    memset(raw + (n < 0 ? 0 : n), 0, GROUP_BYTES - (n < 0 ? 0 : n));
+    __atomic_add_fetch(&groupsUnpacked, 1, __ATOMIC_RELAXED);
+    return n;
+}
+
+// A frame needs 'n' contiguous blocks: shorter free runs met on the way
+// are handed back. Returns 0 if none was found.
+int alloc_frame(uint64_t n, blk_t *start) {
+    BlockRun skipped[FRAME_ALLOC_TRIES];
+    int k = 0, found = 0;
+    if (!ensure_free_blocks(n)) return 0;
+    while (k < FRAME_ALLOC_TRIES) {
+        uint64_t got = alloc_block_run(n, start);
+        if (got == n) {
+            found = 1;
+            break;
+        }
+        if (got == 0) break;
+        skipped[k++] = (BlockRun){ *start, got };
+    }
+    // never referenced, so they can go straight back to the bitmap
+    while (k--) clear_block_run(skipped[k].start, skipped[k].len);
+    return found;
+}
+
+// Pack raw[0, rawLen) into a new frame for group x->logical, using
+// 'scratch' (GROUP_BYTES) for the encoder. Returns -1 if there is no room.
+int encode_frame(const unsigned char *raw, uint32_t rawLen, unsigned char *scratch, Extent *x) {
+    // only worth it if strictly smaller: equal lengths mean "stored"
+    size_t packed = rawLen ? lz_compress(raw, rawLen, scratch, rawLen - 1) : 0;
+    FrameHeader h = { rawLen, packed ? (uint32_t)packed : rawLen };
+    uint64_t bytes = sizeof(h) + h.packedLen;
+    uint64_t n = (bytes + blockSize - 1) / blockSize;
+    if (!alloc_frame(n, &x->start)) return -1;
+    x->len = n;
+
+    unsigned char *p = cache_run(x->start, n, 1);
+    memcpy(p, &h, sizeof(h));
+    memcpy(p + sizeof(h), packed ? scratch : raw, h.packedLen);
+    memset(p + bytes, 0, n * blockSize - bytes);
+    __atomic_add_fetch(&groupsPacked, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Writes to a compressed file go through a GroupWriter, which holds one
+ * decoded group and packs it into a new frame when the write moves on.
+ * Writes move forward through the file. Replaced frames are kept until
+ * gw_finish, so a write that runs out of space leaves the file as it
+ * was. */
+typedef struct {
+    FSNode *f;
+    unsigned char *raw;        // the held group, decoded
+    unsigned char *packed;     // encoder output
+    uint64_t group;            // index of the held group, NO_BLOCK if none
+    int dirty;
+    int oldGroups;
+    uint64_t oldBytes, oldBlocks;
+    Extent *replaced;          // frames replaced so far, in order
+    int replacedCount, replacedCap;
+} GroupWriter;
+
+void gw_open(GroupWriter *w, FSNode *f) {
+    w->f = f;
+    w->raw = malloc(GROUP_BYTES);
+    w->packed = malloc(GROUP_BYTES);
+    w->group = NO_BLOCK;
+    w->dirty = 0;
+    w->oldGroups = f->extentCount;
+    w->oldBytes = f->contentBytes;
+    w->oldBlocks = f->blockCount;
+    w->replaced = NULL;
+    w->replacedCount = w->replacedCap = 0;
+}
+
+// Pack the held group into a new frame
+int gw_flush(GroupWriter *w) {
+    if (!w->dirty) return 0;
+    FSNode *f = w->f;
+    uint64_t from = w->group * GROUP_BYTES;
+    uint64_t rawLen = f->contentBytes - from < GROUP_BYTES ? f->contentBytes - from : GROUP_BYTES;
+
+    Extent x = { w->group, 0, 0 };
+    if (encode_frame(w->raw, rawLen, w->packed, &x) < 0) return -1;
+    if (w->group < (uint64_t)f->extentCount) {
+        if (w->replacedCount == w->replacedCap) {
+            w->replacedCap = w->replacedCap ? w->replacedCap * 2 : 16;
+            w->replaced = realloc(w->replaced, sizeof(Extent) * w->replacedCap);
+        }
+        w->replaced[w->replacedCount++] = f->extents[w->group];
+        f->blockCount -= f->extents[w->group].len;
+        f->extents[w->group] = x;
+    } else {
+        // groups are only ever added at the end
+        reserve_extents(f, f->extentCount + 1);
+        f->extents[f->extentCount++] = x;
+    }
+    f->blockCount += x.len;
+    w->dirty = 0;
+    return 0;
+}
+
+// Make group g the held one
+int gw_seek(GroupWriter *w, uint64_t g) {
+    if (g == w->group) return 0;
+    if (gw_flush(w) < 0) return -1;
+    if (g < (uint64_t)w->f->extentCount) decode_frame(&w->f->extents[g], w->raw);
+    else memset(w->raw, 0, GROUP_BYTES);
+    w->group = g;
+    return 0;
+}
+
+// Write 'len' bytes at 'off'; a gap past the end of the file is zeros
+int gw_write(GroupWriter *w, uint64_t off, const void *data, size_t len) {
+    FSNode *f = w->f;
+    while (f->contentBytes < off) {
+        uint64_t g = f->contentBytes / GROUP_BYTES, groupEnd = (g + 1) * GROUP_BYTES;
+        if (gw_seek(w, g) < 0) return -1;
+        w->dirty = 1;
+        f->contentBytes = off < groupEnd ? off : groupEnd;
+    }
+
+    const unsigned char *src = data;
+    uint64_t pos = off, end = off + len;
+    while (pos < end) {
+        uint64_t o = pos % GROUP_BYTES;
+        uint64_t chunk = end - pos < GROUP_BYTES - o ? end - pos : GROUP_BYTES - o;
+        if (gw_seek(w, pos / GROUP_BYTES) < 0) return -1;
+        memcpy(w->raw + o, src, chunk);
+        w->dirty = 1;
+        src += chunk;
+        pos += chunk;
+        if (pos > f->contentBytes) f->contentBytes = pos;
+    }
+    return 0;
+}
+
+// Complete a write: store the map and free the frames it replaced. If
+// 'ok' is clear or that fails, the old frames are put back instead.
+// Returns -1 if the write did not take.
+int gw_finish(GroupWriter *w, int ok) {
+    FSNode *f = w->f;
+    if (ok && (gw_flush(w) < 0 || store_file_map(f) < 0)) ok = 0;
+
+    if (ok) {
+        for (int i = 0; i < w->replacedCount; i++)
+            free_block_run(w->replaced[i].start, w->replaced[i].len);
+    } else {
+        // newest first, so a group replaced twice ends up with its original
+        for (int i = w->replacedCount - 1; i >= 0; i--) {
+            Extent *x = &f->extents[w->replaced[i].logical];
+            free_block_run(x->start, x->len);
+            *x = w->replaced[i];
+        }
+        free_extents(f->extents + w->oldGroups, f->extentCount - w->oldGroups);
+        f->extentCount = w->oldGroups;
+        f->contentBytes = w->oldBytes;
+        f->blockCount = w->oldBlocks;
+        store_file_map(f);
+    }
+    free(w->raw);
+    free(w->packed);
+    free(w->replaced);
+    return ok ? 0 : -1;
+}
+
+// write_file_range for a compressed file
+int packed_write(FSNode *f, uint64_t off, const char *data, size_t len) {
+    GroupWriter w;
+    gw_open(&w, f);
+    return gw_finish(&w, gw_write(&w, off, data, len) == 0);
+}
+
+// import_fd for a compressed file, a group per read()
+int packed_import(FSNode *f, int fd) {
+    GroupWriter w;
+    gw_open(&w, f);
+    unsigned char *buf = malloc(GROUP_BYTES);
+    int r = 0;
+    while (1) {
+        ssize_t got = read(fd, buf, GROUP_BYTES);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            r = -2;
+            break;
+        }
+        if (got == 0) break;
+        if (gw_write(&w, f->contentBytes, buf, got) < 0) {
+            r = -1;
+            break;
+        }
+    }
+    int err = errno;
+    free(buf);
+    if (gw_finish(&w, r == 0) < 0 && r == 0) r = -1;
+    errno = err;
+    return r;
+}
+
+// send_file_range for a compressed file: only the groups covering
+// [off, off+len) are decoded
+int send_packed_range(FSNode *f, uint64_t off, uint64_t len, int fd, FILE *out) {
+    unsigned char *raw = malloc(GROUP_BYTES);
+    uint64_t pos = off, end = off + len;
+    int r = 0;
+    while (pos < end && r == 0) {
+        uint64_t o = pos % GROUP_BYTES;
+        uint64_t chunk = end - pos < GROUP_BYTES - o ? end - pos : GROUP_BYTES - o;
+        decode_frame(&f->extents[pos / GROUP_BYTES], raw);
+        r = put_bytes(fd, out, raw + o, chunk);
+        pos += chunk;
+    }
+    free(raw);
+    return r;
+}
+
+int fill_file_range(FSNode *f, uint64_t off, const char *data, size_t len);
+int commit_file_growth(FSNode *f, uint64_t oldCount, uint64_t oldBytes, uint64_t from, uint64_t to);
+
+// Re-encode a file for the other storage mode. Its old blocks are only
+// freed once the new copy is complete; if the disk fills up first the
+// file is left as it was and -1 returned.
+int set_compressed(FSNode *f, int on) {
+    load_file_map(f);
+    if (f->compressed == on) return 0;
+    if (uninline_file(f) < 0) return -1;
+
+    Extent *old = f->extents;
+    int oldCount = f->extentCount, oldCap = f->extentCap;
+    uint64_t oldBlocks = f->blockCount, bytes = f->contentBytes;
+    f->extents = NULL;
+    f->extentCount = f->extentCap = 0;
+    f->blockCount = f->contentBytes = 0;
+    f->compressed = on;
+
+    int r = 0;
+    if (on) {
+        GroupWriter w;
+        gw_open(&w, f);
+        for (int e = 0; e < oldCount && r == 0; e++) {
+            uint64_t from = old[e].logical * blockSize;
+            if (from >= bytes) break;
+            uint64_t n = old[e].len * blockSize < bytes - from ? old[e].len * blockSize : bytes - from;
+            r = gw_write(&w, from, cache_run(old[e].start, old[e].len, 0), n);
+        }
+        r = gw_finish(&w, r == 0);
+    } else {
+        unsigned char *raw = malloc(GROUP_BYTES);
+        for (int g = 0; g < oldCount && r == 0; g++) {
+            uint64_t from = g * GROUP_BYTES;
+            decode_frame(&old[g], raw);
+            r = fill_file_range(f, from, (const char *)raw, bytes - from < GROUP_BYTES ? bytes - from : GROUP_BYTES);
+        }
+        free(raw);
+        if (r == 0) r = commit_file_growth(f, 0, 0, 0, bytes);
+    }
+
+    if (r < 0) {
+        release_file_data(f);
+        f->compressed = !on;
+        f->extents = old;
+        f->extentCount = oldCount;
+        f->extentCap = oldCap;
+        f->blockCount = oldBlocks;
+        f->contentBytes = bytes;
+        store_file_map(f);
+        return -1;
+    }
+    free_extents(old, oldCount);
+    free(old);
+    return store_file_map(f);
+}
+
+/* ------------------------ Path resolution ------------------------ */
+
+// Canonical path of a node, cached on the node. Paths never change once
+// a node is linked, so the cache needs no invalidation. Concurrent
+// builders race to install theirs; the loser frees its copy.
+const char *node_path(FSNode *n) {
+    char *cached = __atomic_load_n(&n->path, __ATOMIC_ACQUIRE);
+    if (cached) return cached;
+
+    char *path;
+    if (n == rootDir || !n->parent) {
+        path = strdup("/");
+    } else {
+        const char *pp = node_path(n->parent);
+        size_t pl = strlen(pp), nl = strlen(n->name);
+        if (pl == 1) pl = 0;            // parent is root, no double slash
+
+        path = malloc(pl + nl + 2);
+        memcpy(path, pp, pl);
+        path[pl] = '/';
+        memcpy(path + pl + 1, n->name, nl + 1);
+    }
+    if (!__atomic_compare_exchange_n(&n->path, &cached, path, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(path);
+        return cached;
+    }
+    return path;
+}
+
+// Walk components of 'path' starting at 'base'; NULL if any component
+// is missing or a non-final component is not a directory.
+FSNode *walk_path(FSNode *base, const char *path) {
+    FSNode *cur = (*path == '/') ? rootDir : base;
+    const char *p = path;
+
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+
+        const char *e = p;
+        while (*e && *e != '/') e++;
+        size_t len = e - p;
+
+        if (!cur->isDirectory) return NULL;
+
+        if (len == 1 && p[0] == '.') {
+            // stay
+        } else if (len == 2 && p[0] == '.' && p[1] == '.') {
+            if (cur->parent) cur = cur->parent;
+        } else {
+            char name[MAX_NAME+1];
+            if (len > MAX_NAME) len = MAX_NAME;
+            memcpy(name, p, len);
+            name[len] = '\0';
+            cur = find_child(cur, name);
+            if (!cur) return NULL;
+        }
+        p = e;
+    }
+    return cur;
+}
+
+// Resolve an absolute or relative path. Single names go straight to the
+// directory index; multi-component paths go through the dentry cache.
+FSNode *resolve_path(FSNode *base, const char *path) {
+    COUNT(pathLookups, 1);
+    if (!strchr(path, '/')) {
+        if (strcmp(path, ".") == 0) return base;
+        if (strcmp(path, "..") == 0) return base->parent ? base->parent : base;
+        return find_child(base, path);
+    }
+
+    size_t len = strlen(path);
+    if (len >= DCACHE_PATH_MAX) return walk_path(base, path);
+
+    if (*path == '/') base = rootDir;
+    unsigned int h = (name_hash(path) ^ (unsigned int)((uintptr_t)base >> 4)) & (DCACHE_SIZE - 1);
+    DentryEntry *e = &dcache[h];
+    pthread_mutex_t *lock = &dcacheLocks[h & (DCACHE_LOCKS - 1)];
+
+    pthread_mutex_lock(lock);
+    FSNode *n = NULL;
+    if (e->gen == dcacheGen && e->base == base && strcmp(e->path, path) == 0)
+        n = e->node;
+    pthread_mutex_unlock(lock);
+    if (n) {
+        COUNT(dcacheHits, 1);
+        return n;
+    }
+    COUNT(dcacheMisses, 1);
+
+    n = walk_path(base, path);
+    if (n) {
+        pthread_mutex_lock(lock);
+        e->base = base;
+        e->node = n;
+        e->gen = dcacheGen;
+        memcpy(e->path, path, len + 1);
+        pthread_mutex_unlock(lock);
+    }
+    return n;
+}
+
+// Split 'path' (relative to base) into its parent directory and final name.
+// Returns the parent (NULL if missing / not a directory); 'leaf' gets the name.
+FSNode *resolve_parent(FSNode *base, const char *path, char *leaf) {
+    char buf[4096];
+    strncpy(buf, path, sizeof(buf)-1);
+    buf[sizeof(buf)-1] = '\0';
+
+    // drop trailing slashes ("a/b/" -> "a/b")
+    size_t len = strlen(buf);
+    while (len > 1 && buf[len-1] == '/') buf[--len] = '\0';
+
+    char *slash = strrchr(buf, '/');
+    FSNode *parent;
+    const char *name;
+    if (!slash) {
+        parent = base;
+        name = buf;
+    } else {
+        name = slash + 1;
+        if (slash == buf) parent = rootDir;
         else {
-            FSNode *t = currentDir;
-            char tmp[4096] = "";
-            while (t && t != rootDir) {
-                char buf[256];
-                snprintf(buf, sizeof(buf), "/%s", t->name);
-                char join[4096];
-                strcpy(join, buf);
-                strcat(join, tmp);
-                strcpy(tmp, join);
-                t = t->parent;
+            *slash = '\0';
+            parent = resolve_path(base, buf);
+        }
+    }
+
+    strncpy(leaf, name, MAX_NAME);
+    leaf[MAX_NAME] = '\0';
+    if (!parent || !parent->isDirectory) return NULL;
+    return parent;
+}
+
+int valid_name(const char *name) {
+    return name[0] && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+/* ------------------------ Background threads ------------------------ */
+
+// Only the server's accept loop handles SIGINT/SIGTERM
+void block_stop_signals() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+void *commit_main(void *arg) {
+    block_stop_signals();
+    return commit_thread(arg);
+}
+
+pthread_t committer;
+int committerRunning = 0;
+
+// Once commands can run on more than one thread, nobody may commit from
+// inside a command: commits move to their own thread
+void start_committer() {
+    if (committerRunning) return;
+    serverMode = 1;
+    commitStop = 0;
+    pthread_create(&committer, NULL, commit_main, NULL);
+    committerRunning = 1;
+}
+
+void stop_committer() {
+    if (!committerRunning) return;
+    pthread_mutex_lock(&commitMutex);
+    commitStop = 1;
+    pthread_cond_signal(&commitCond);
+    pthread_mutex_unlock(&commitMutex);
+    pthread_join(committer, NULL);
+    committerRunning = 0;
+}
+
+/* Online defragmenter. One step takes the next file in inode order that
+ * has work and either moves a window of its extents (up to
+ * DEFRAG_STEP_BLOCKS, and no more than a second's budget) into one free
+ * run, or, once the file is contiguous, moves it down into a free run
+ * below it. Runs are found first-fit from block 0, so data packs
+ * towards the start of the disk and free space gathers at the end. A
+ * step runs like any command: txLock and nsLock shared, the file's lock
+ * exclusive. The copies are new blocks and the old ones are freed with
+ * the transaction, so a crash leaves either map intact. Shared blocks
+ * stay put (moving them would unshare them) and compressed files are
+ * skipped (each frame is already one run). The thread sleeps off what
+ * it moved at defragRate blocks a second. */
+#define DEFRAG_STEP_BLOCKS 2048
+#define DEFRAG_SCAN        4096    // inodes looked at per step
+#define DEFRAG_IDLE_MS     1000    // after a pass that found nothing
+
+pthread_t defragThread;
+int defragRunning = 0;
+int defragStop = 0;
+uint64_t defragRate = 0;       // blocks per second; 0 pauses the thread
+pthread_mutex_t defragMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t defragCond = PTHREAD_COND_INITIALIZER;
+
+// First run of 'want' free blocks in a shard starting below 'below',
+// scanning from the shard's start; caller holds the shard lock. Marks
+// the run used.
+int shard_fit(AllocShard *sh, uint64_t want, blk_t below, blk_t *start) {
+    blk_t limit = sh->endWord * 64 < TOTAL_BLOCKS ? sh->endWord * 64 : TOTAL_BLOCKS;
+    blk_t run = 0;
+    uint64_t len = 0;
+    for (blk_t b = sh->firstWord * 64; b < limit && len < want && (len || b < below); ) {
+        uint64_t word = blockBitmap[b >> 6];
+        if ((b & 63) == 0 && (word == 0 || word == ~0ULL)) {
+            if (word) {
+                len = 0;
+            } else {
+                if (!len) run = b;
+                len += 64;
+            }
+            b += 64;
+            continue;
+        }
+        if (block_in_use(b)) {
+            len = 0;
+        } else {
+            if (!len) run = b;
+            len++;
+        }
+        b++;
+    }
+    if (len < want) return 0;
+
+    for (blk_t b = run; b < run + want; b++)
+        blockBitmap[b >> 6] |= 1ULL << (b & 63);
+    *start = run;
+    return 1;
+}
+
+// A contiguous run of exactly 'want' blocks starting below 'below'
+// (NO_BLOCK: anywhere), or 0 if there is none
+int alloc_fit_run(uint64_t want, blk_t below, blk_t *start) {
+    for (int i = 0; i < shardCount && allocShards[i].firstWord * 64 < below; i++) {
+        AllocShard *sh = &allocShards[i];
+        pthread_mutex_lock(&sh->lock);
+        int ok = shard_fit(sh, want, below, start);
+        pthread_mutex_unlock(&sh->lock);
+        if (!ok) continue;
+
+        __atomic_sub_fetch(&freeBlockCount, want, __ATOMIC_RELAXED);
+        COUNT(blocksAllocated, want);
+        mark_dirty(&blockBitmap[*start >> 6], (size_t)(((*start + want - 1) >> 6) - (*start >> 6) + 1) * sizeof(uint64_t));
+        return 1;
+    }
+    return 0;
+}
+
+int extent_shared(const Extent *x) {
+    if (!sharingEnabled) return 0;
+    for (blk_t b = x->start; b < x->start + x->len; b++)
+        if (__atomic_load_n(&blockShares[b], __ATOMIC_RELAXED)) return 1;
+    return 0;
+}
+
+// Lowest free block (a hint: nothing is locked)
+blk_t lowest_free() {
+    for (uint64_t w = 0; w < bitmapWords; w++) {
+        uint64_t word = __atomic_load_n(&blockBitmap[w], __ATOMIC_RELAXED);
+        if (word != ~0ULL) return w * 64 + __builtin_ctzll(~word);
+    }
+    return NO_BLOCK;
+}
+
+// A contiguous file: copy it into a free run below it, if there is one
+uint64_t compact_file(FSNode *f, uint64_t max, blk_t lowFree) {
+    Extent *x = &f->extents[0];
+    blk_t start;
+    if (x->len > max || x->start < lowFree || extent_shared(x) ||
+        !alloc_fit_run(x->len, x->start, &start))
+        return 0;
+    memcpy(cache_run(start, x->len, 1), block_data(x->start), x->len * blockSize);
+    Extent old = *x;
+    x->start = start;
+    if (store_file_map(f) < 0) {
+        *x = old;
+        clear_block_run(start, old.len);
+        return 0;
+    }
+    free_extents(&old, 1);
+    return old.len;
+}
+
+// Move the first window of two or more unshared extents (at most 'max'
+// blocks) into one run, or compact a file that has no such window.
+// Returns the blocks moved; caller holds the file's lock exclusively.
+uint64_t defrag_file(FSNode *f, uint64_t max, blk_t lowFree) {
+    load_file_map(f);
+    if (f->compressed || f->extentCount == 0) return 0;
+    if (f->extentCount == 1) return compact_file(f, max, lowFree);
+
+    int i = 0, j = 0;
+    uint64_t total = 0;
+    for (; i + 1 < f->extentCount; i++) {
+        if (f->extents[i].len >= max || extent_shared(&f->extents[i])) continue;
+        total = f->extents[i].len;
+        for (j = i; j + 1 < f->extentCount && total + f->extents[j + 1].len <= max &&
+                    !extent_shared(&f->extents[j + 1]); j++)
+            total += f->extents[j + 1].len;
+        if (j > i) break;
+    }
+    if (i + 1 >= f->extentCount) return 0;
+
+    blk_t start;
+    if (!alloc_fit_run(total, NO_BLOCK, &start)) return 0;
+    unsigned char *dst = cache_run(start, total, 1);
+    for (int k = i; k <= j; k++) {
+        memcpy(dst, block_data(f->extents[k].start), f->extents[k].len * blockSize);
+        dst += f->extents[k].len * blockSize;
+    }
+
+    // the old runs are freed only once the new map is stored; if that
+    // fails the file keeps them and the new run (never referenced) goes back
+    int oldCount = f->extentCount;
+    Extent *old = malloc(sizeof(Extent) * oldCount);
+    memcpy(old, f->extents, sizeof(Extent) * oldCount);
+    f->extents[i].start = start;
+    f->extents[i].len = total;
+    memmove(&f->extents[i + 1], &f->extents[j + 1], sizeof(Extent) * (f->extentCount - j - 1));
+    f->extentCount -= j - i;
+    coalesce_extents(f);
+    if (store_file_map(f) < 0) {
+        memcpy(f->extents, old, sizeof(Extent) * oldCount);
+        f->extentCount = oldCount;
+        clear_block_run(start, total);
+        total = 0;
+    } else {
+        free_extents(&old[i], j - i + 1);
+    }
+    free(old);
+    return total;
+}
+
+// Find an inode's node, loading directories on the way down
+FSNode *node_for_inode(uint32_t ino) {
+    uint32_t *chain = NULL;
+    int depth = 0, cap = 0;
+    for (uint32_t i = ino; inodeTable[i].parent != NO_INODE; i = inodeTable[i].parent) {
+        if (depth == cap) {
+            cap = cap ? cap * 2 : 32;
+            chain = realloc(chain, sizeof(uint32_t) * cap);
+        }
+        chain[depth++] = i;
+    }
+    FSNode *n = rootDir;
+    while (n && depth > 0) {
+        uint32_t i = chain[--depth];
+        n = find_child(n, inodeTable[i].name);
+        if (n && n->ino != i) n = NULL;
+    }
+    free(chain);
+    return n;
+}
+
+// One step from *cursor: the blocks moved, 0 if the next DEFRAG_SCAN
+// inodes held nothing to do. *wrapped is set at the end of the table.
+uint64_t defrag_step(uint32_t *cursor, uint64_t max, int *wrapped) {
+    uint64_t moved = 0;
+    pthread_rwlock_rdlock(&txLock);
+    pthread_rwlock_rdlock(&nsLock);
+    blk_t lowFree = lowest_free();
+    for (int n = 0; n < DEFRAG_SCAN && !moved; n++) {
+        uint32_t ino = (*cursor)++;
+        if (*cursor >= super->inodeCount) {
+            *cursor = 0;
+            *wrapped = 1;
+        }
+        const DiskInode *d = &inodeTable[ino];
+        if ((d->flags & (INODE_USED | INODE_DIR | INODE_COMPRESSED)) != INODE_USED) continue;
+        uint32_t extents = __atomic_load_n(&d->extentCount, __ATOMIC_RELAXED);
+        if (extents == 0 || (extents == 1 && d->ext[0].start < lowFree)) continue;
+
+        FSNode *f = node_for_inode(ino);
+        if (!f) continue;
+        pthread_rwlock_wrlock(&f->lock);
+        moved = defrag_file(f, max, lowFree);
+        pthread_rwlock_unlock(&f->lock);
+        // come back to this file until it is done
+        if (moved) *cursor = ino;
+    }
+    pthread_rwlock_unlock(&nsLock);
+    pthread_rwlock_unlock(&txLock);
+
+    if (moved) {
+        COUNT(defragBlocks, moved);
+        COUNT(defragMoves, 1);
+        journal_op_done();
+    }
+    return moved;
+}
+
+void *defrag_main(void *arg) {
+    (void)arg;
+    block_stop_signals();
+    uint32_t cursor = 0;
+    int wrapped = 0, idle = 1;
+
+    pthread_mutex_lock(&defragMutex);
+    while (!defragStop) {
+        uint64_t rate = defragRate;
+        if (rate == 0) {
+            pthread_cond_wait(&defragCond, &defragMutex);
+            continue;
+        }
+        pthread_mutex_unlock(&defragMutex);
+
+        uint64_t moved = defrag_step(&cursor, rate < DEFRAG_STEP_BLOCKS ? rate : DEFRAG_STEP_BLOCKS, &wrapped);
+        if (moved) idle = 0;
+        long long waitMs = (long long)(moved * 1000 / rate);
+        if (wrapped) {
+            // a whole pass without work: the disk is as tidy as it gets
+            if (idle) waitMs = DEFRAG_IDLE_MS;
+            wrapped = 0;
+            idle = 1;
+        }
+
+        pthread_mutex_lock(&defragMutex);
+        if (waitMs > 0 && !defragStop) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += waitMs / 1000;
+            ts.tv_nsec += (waitMs % 1000) * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&defragCond, &defragMutex, &ts);
+        }
+    }
+    pthread_mutex_unlock(&defragMutex);
+    return NULL;
+}
+
+// Start the defragmenter, or change its rate (0 pauses it)
+void set_defrag_rate(uint64_t rate) {
+    pthread_mutex_lock(&defragMutex);
+    defragRate = rate;
+    pthread_cond_signal(&defragCond);
+    pthread_mutex_unlock(&defragMutex);
+    if (rate && !defragRunning) {
+        start_committer();
+        defragStop = 0;
+        pthread_create(&defragThread, NULL, defrag_main, NULL);
+        defragRunning = 1;
+    }
+}
+
+void stop_defrag() {
+    if (!defragRunning) return;
+    pthread_mutex_lock(&defragMutex);
+    defragStop = 1;
+    pthread_cond_signal(&defragCond);
+    pthread_mutex_unlock(&defragMutex);
+    pthread_join(defragThread, NULL);
+    defragRunning = 0;
+}
+
+// File fragmentation from the inode table and free-space fragmentation
+// from the bitmap; a full scan of both, for the defrag report
+typedef struct {
+    uint64_t files, fragmented, extents;
+    uint64_t freeBlocks, freeRuns, largestFree;
+} FragReport;
+
+void measure_fragmentation(FragReport *r) {
+    memset(r, 0, sizeof(*r));
+    for (uint32_t i = 0; i < super->inodeCount; i++) {
+        const DiskInode *d = &inodeTable[i];
+        if ((d->flags & (INODE_USED | INODE_DIR | INODE_COMPRESSED)) != INODE_USED) continue;
+        uint32_t n = __atomic_load_n(&d->extentCount, __ATOMIC_RELAXED);
+        if (n == 0) continue;
+        r->files++;
+        r->extents += n;
+        if (n > 1) r->fragmented++;
+    }
+
+    uint64_t run = 0;
+    for (blk_t b = 0; b < TOTAL_BLOCKS; ) {
+        uint64_t word = __atomic_load_n(&blockBitmap[b >> 6], __ATOMIC_RELAXED);
+        int whole = (b & 63) == 0 && (word == 0 || word == ~0ULL);
+        int used = whole ? word != 0 : (int)((word >> (b & 63)) & 1);
+        uint64_t step = whole ? 64 : 1;
+        if (used) {
+            run = 0;
+        } else {
+            if (!run) r->freeRuns++;
+            run += step;
+            r->freeBlocks += step;
+            if (run > r->largestFree) r->largestFree = run;
+        }
+        b += step;
+    }
+}
+
+/* ------------------------ Commands ------------------------ */
+
+// mkdir
+// New empty node 'name' under parent, linked on disk too.
+// NULL if there are no free inodes.
+FSNode *make_node(FSNode *parent, const char *name, int isDir) {
+    uint32_t ino = alloc_inode(name, isDir);
+    if (ino == NO_INODE) return NULL;
+    FSNode *n = new_node(name, isDir);
+    n->ino = ino;
+    inode_link(parent->ino, ino);
+    add_child(parent, n);
+    return n;
+}
+
+void do_mkdir(VfsSession *s, char *path) {
+    if (!path) {
+        fprintf(s->out, "Usage: mkdir <name>\n");
+        return;
+    }
+    char name[MAX_NAME+1];
+    FSNode *parent = resolve_parent(s->cwd, path, name);
+    if (!parent) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (!valid_name(name)) {
+        fprintf(s->out, "Invalid name.\n");
+        return;
+    }
+    if (find_child(parent, name)) {
+        fprintf(s->out, "Already exists.\n");
+        return;
+    }
+    if (!make_node(parent, name, 1)) {
+        fprintf(s->out, "No free inodes.\n");
+        return;
+    }
+    fprintf(s->out, "Directory '%s' created.\n", path);
+}
+
+void do_create(VfsSession *s, char *path) {
+    if (!path) {
+        fprintf(s->out, "Usage: create <name>\n");
+        return;
+    }
+    char name[MAX_NAME+1];
+    FSNode *parent = resolve_parent(s->cwd, path, name);
+    if (!parent) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (!valid_name(name)) {
+        fprintf(s->out, "Invalid name.\n");
+        return;
+    }
+    if (find_child(parent, name)) {
+        fprintf(s->out, "Already exists.\n");
+        return;
+    }
+    if (!make_node(parent, name, 0)) {
+        fprintf(s->out, "No free inodes.\n");
+        return;
+    }
+    fprintf(s->out, "File '%s' created.\n", path);
+}
+
+#define SNAPSHOT_DIR ".snapshots"
+
+// Give the new, empty file n the contents of src. Data is not copied:
+// n shares src's blocks (and frames) until either side writes to them.
+int clone_file(FSNode *src, FSNode *n) {
+    load_file_map(src);
+    if (src->inlined) {
+        inline_write(n, 0, (const char *)inline_bytes(src->ino), src->contentBytes);
+        return 0;
+    }
+    reserve_extents(n, src->extentCount);
+    memcpy(n->extents, src->extents, sizeof(Extent) * src->extentCount);
+    n->extentCount = src->extentCount;
+    n->blockCount = src->blockCount;
+    n->contentBytes = src->contentBytes;
+    n->compressed = src->compressed;
+    share_extents(n->extents, n->extentCount);
+    if (store_file_map(n) < 0) {
+        release_file_data(n);
+        store_file_map(n);
+        return -1;
+    }
+    return 0;
+}
+
+// Copy 'src' into parent as 'name', a directory with everything below
+// it except 'skip'. Only data blocks are shared (copy-on-write); every
+// node gets its own inode, block map and attributes, so the cost is
+// linear in the number of nodes copied, not in bytes. Returns -1 when
+// inodes or map blocks run out; the partial copy stays.
+int clone_node(FSNode *src, FSNode *parent, const char *name, FSNode *skip) {
+    WalkStack w = { 0 };
+    WalkItem it;
+    int r = 0;
+    walk_push(&w, src, parent);
+    while (r == 0 && walk_pop(&w, &it)) {
+        if (it.node == skip) continue;
+        FSNode *n = make_node(it.dest, it.node == src ? name : it.node->name, it.node->isDirectory);
+        if (!n) r = -1;
+        else if (it.node->isDirectory) walk_children(&w, it.node, n, 1);
+        else r = clone_file(it.node, n);
+        if (n && r == 0) r = clone_attrs(it.node->ino, n->ino);
+    }
+    free(w.items);
+    return r;
+}
+
+int cmp_runs(const void *a, const void *b) {
+    blk_t x = ((const BlockRun *)a)->start, y = ((const BlockRun *)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+// Release many runs at once: sorted and merged where they touch, then
+// handed over under one hold of the share lock
+void release_runs(BlockRun *runs, uint64_t count) {
+    if (count == 0) return;
+    qsort(runs, count, sizeof(BlockRun), cmp_runs);
+    uint64_t out = 0;
+    for (uint64_t i = 1; i < count; i++) {
+        if (runs[out].start + runs[out].len == runs[i].start) runs[out].len += runs[i].len;
+        else runs[++out] = runs[i];
+    }
+    count = out + 1;
+
+    if (sharingEnabled) pthread_mutex_lock(&dedupLock);
+    for (uint64_t i = 0; i < count; i++) {
+        if (sharingEnabled) drop_refs_locked(runs[i].start, runs[i].len);
+        else queue_free_run(runs[i].start, runs[i].len);
+    }
+    if (sharingEnabled) pthread_mutex_unlock(&dedupLock);
+}
+
+// Remove a node and everything below it. The data blocks and map
+// chains of the whole subtree are gathered and released in one pass.
+// Returns -1, removing nothing, if a directory in it is some session's
+// working directory.
+int remove_tree(VfsSession *s, FSNode *top) {
+    WalkStack w = { 0 }, all = { 0 };
+    WalkItem it;
+    int busy = 0;
+    walk_push(&w, top, NULL);
+    while (!busy && walk_pop(&w, &it)) {
+        FSNode *n = it.node;
+        if (n->isDirectory) {
+            busy = n == s->cwd || __atomic_load_n(&n->cwdRefs, __ATOMIC_ACQUIRE) > 0;
+            walk_children(&w, n, NULL, 1);
+        }
+        walk_push(&all, n, NULL);
+    }
+    free(w.items);
+    if (busy) {
+        free(all.items);
+        return -1;
+    }
+
+    // a directory inode holds its subtree's totals
+    DiskInode *d = &inodeTable[top->ino];
+    account_tree(top->ino, -(int64_t)d->contentBytes, -(int64_t)d->blockCount);
+    inode_unlink(top->ino);
+    detach_child(top->parent, top);
+
+    BlockRun *runs = NULL;
+    uint64_t count = 0, cap = 0;
+    for (int i = 0; i < all.count; i++) {
+        FSNode *n = all.items[i].node;
+        if (!n->isDirectory) {
+            load_file_map(n);
+            for (int e = 0; e < n->extentCount; e++) {
+                if (count == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    runs = realloc(runs, sizeof(BlockRun) * cap);
+                }
+                runs[count++] = (BlockRun){ n->extents[e].start, n->extents[e].len };
+            }
+            for (blk_t b = inodeTable[n->ino].mapBlock; b != NO_BLOCK; b = map_block(b)->next) {
+                if (count == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    runs = realloc(runs, sizeof(BlockRun) * cap);
+                }
+                runs[count++] = (BlockRun){ b, 1 };
+            }
+            free(n->extents);
+        }
+        free_inode(n->ino);
+        free_node(n);
+    }
+    release_runs(runs, count);
+    free(runs);
+    free(all.items);
+    return 0;
+}
+
+// cp [-r] <src> <dst>: copy a file, or with -r a directory tree. If dst
+// is an existing directory the copy goes inside it under src's name.
+void do_cp(VfsSession *s, int recursive, char *src, char *dst) {
+    if (!src || !dst) {
+        fprintf(s->out, "Usage: cp [-r] <src> <dst>\n");
+        return;
+    }
+    if (!sharingEnabled) {
+        fprintf(s->out, "This image can't share blocks.\n");
+        return;
+    }
+    FSNode *from = resolve_path(s->cwd, src);
+    if (!from) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (from->isDirectory && !recursive) {
+        fprintf(s->out, "'%s' is a directory (use cp -r).\n", src);
+        return;
+    }
+
+    char name[MAX_NAME+1];
+    FSNode *parent = resolve_path(s->cwd, dst);
+    if (parent && parent->isDirectory) {
+        strcpy(name, from->name);
+    } else if (!(parent = resolve_parent(s->cwd, dst, name))) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (!valid_name(name)) {
+        fprintf(s->out, "Invalid name.\n");
+        return;
+    }
+    if (find_child(parent, name)) {
+        fprintf(s->out, "Already exists.\n");
+        return;
+    }
+    for (FSNode *p = parent; p; p = p->parent) {
+        if (p == from) {
+            fprintf(s->out, "Can't copy a directory into itself.\n");
+            return;
+        }
+    }
+
+    if (clone_node(from, parent, name, NULL) < 0) fprintf(s->out, "No space left; copy is incomplete.\n");
+    else fprintf(s->out, "Copied '%s' to '%s'.\n", src, dst);
+}
+
+// snapshot <name>: copy the whole tree to /.snapshots/<name>. Data is
+// shared, metadata copied (see clone_node): the snapshot takes time and
+// inodes in proportion to the tree, under an exclusive nsLock.
+void do_snapshot(VfsSession *s, char *name) {
+    if (!name) {
+        fprintf(s->out, "Usage: snapshot <name>\n");
+        return;
+    }
+    if (!sharingEnabled) {
+        fprintf(s->out, "This image can't share blocks.\n");
+        return;
+    }
+    if (!valid_name(name) || strchr(name, '/')) {
+        fprintf(s->out, "Invalid name.\n");
+        return;
+    }
+    FSNode *dir = find_child(rootDir, SNAPSHOT_DIR);
+    if (!dir && !(dir = make_node(rootDir, SNAPSHOT_DIR, 1))) {
+        fprintf(s->out, "No free inodes.\n");
+        return;
+    }
+    if (!dir->isDirectory) {
+        fprintf(s->out, "'/%s' is not a directory.\n", SNAPSHOT_DIR);
+        return;
+    }
+    if (find_child(dir, name)) {
+        fprintf(s->out, "Already exists.\n");
+        return;
+    }
+
+    if (clone_node(rootDir, dir, name, dir) < 0) fprintf(s->out, "No space left; snapshot is incomplete.\n");
+    else fprintf(s->out, "Snapshot '%s' created.\n", name);
+}
+
+// list
+void do_ls(VfsSession *s, char *path) {
+    FSNode *dir = path ? resolve_path(s->cwd, path) : s->cwd;
+    if (!dir) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (!dir->isDirectory) {
+        fprintf(s->out, "%s\n", dir->name);
+        return;
+    }
+    if (!is_loaded(dir)) load_dir(dir);
+    if (!dir->child) {
+        fprintf(s->out, "(empty)\n");
+        return;
+    }
+    FSNode *c = dir->child;
+    do {
+        fprintf(s->out, "%s%s\n", c->name, c->isDirectory ? "/" : "");
+        c = c->nextSibling;
+    } while (c != dir->child);
+}
+
+// Blocks freed by the open transaction only become reusable once it
+// commits; commit early (before touching anything) if we need them now.
+int ensure_free_blocks(uint64_t n) {
+    if (n > __atomic_load_n(&freeBlockCount, __ATOMIC_RELAXED) && tx_pending()) {
+        // the REPL is the only session, so it may commit from inside a
+        // command; server sessions ask the commit thread and report full
+        if (!serverMode) journal_commit_locked();
+        else request_commit();
+    }
+    return n <= __atomic_load_n(&freeBlockCount, __ATOMIC_RELAXED);
+}
+
+// write to file (overwrite)
+void write_file_data(VfsSession *s, FSNode *file, const char *data, size_t len) {
+    uint64_t needed = (len + blockSize - 1) / blockSize;
+    int small = !file->compressed && len <= INLINE_BYTES;
+
+    // a compressed file needs far less; its writer checks as it goes
+    if (!file->compressed && !small && !ensure_free_blocks(needed)) {
+        fprintf(s->out, "Disk full.\n");
+        return;
+    }
+
+    // free old
+    load_file_map(file);
+    release_file_data(file);
+
+    if (len == 0) {
+        store_file_map(file);
+        touch_inode(file->ino);
+        fprintf(s->out, "(empty data)\n");
+        return;
+    }
+
+    if (small) {
+        store_file_map(file);           // drops the old extents first
+        inline_write(file, 0, data, len);
+        COUNT(bytesWritten, len);
+        touch_inode(file->ino);
+        fprintf(s->out, "Written %zu bytes.\n", len);
+        return;
+    }
+
+    if (file->compressed) {
+        // on failure the file is left empty, as below
+        if (packed_write(file, 0, data, len) < 0) {
+            fprintf(s->out, "Disk full.\n");
+            return;
+        }
+        COUNT(bytesWritten, len);
+        touch_inode(file->ino);
+        fprintf(s->out, "Written %zu bytes.\n", len);
+        return;
+    }
+
+    // grab contiguous runs and copy each run in one go
+    size_t w = 0;
+    while (file->blockCount < needed) {
+        blk_t start = 0;
+        uint64_t run = alloc_block_run(needed - file->blockCount, &start);
+        if (run == 0) break;            // another session got there first
+        extent_append(file, start, run);
+
+        size_t chunk = run * blockSize;
+        if (w + chunk > len) chunk = len - w;
+        unsigned char *dst = cache_run(start, run, 1);
+        memcpy(dst, data + w, chunk);
+
+        if (chunk < run * blockSize)
+            memset(dst + chunk, 0, run * blockSize - chunk);
+
+        w += chunk;
+    }
+    file->contentBytes = len;
+    if (file->blockCount == needed) dedup_range(file, 0, needed);
+
+    if (file->blockCount < needed || store_file_map(file) < 0) {
+        // out of blocks or no room for the block map: leave the file empty
+        release_file_data(file);
+        store_file_map(file);
+        fprintf(s->out, "Disk full.\n");
+        return;
+    }
+
+    COUNT(bytesWritten, len);
+    touch_inode(file->ino);
+    fprintf(s->out, "Written %zu bytes.\n", len);
+}
+
+// Copy 'len' bytes into the file at 'off', growing it if needed, without
+// storing the block map. Only blocks covering [off, off+len) are touched.
+// Returns -1 (nothing copied) if the disk is full.
+int fill_file_range(FSNode *f, uint64_t off, const char *data, size_t len) {
+    uint64_t end = off + len;
+    uint64_t oldCount = f->blockCount;
+    uint64_t needed = (end + blockSize - 1) / blockSize;
+
+    if (needed > oldCount) {
+        // new blocks start zeroed so any gap before 'off' reads as zeros
+        if (!ensure_free_blocks(needed - oldCount) ||
+            grow_file(f, needed - oldCount, 1) < needed - oldCount) {
+            truncate_extents(f, oldCount);
+            return -1;
+        }
+    }
+    uint64_t cowEnd = needed < oldCount ? needed : oldCount;
+    if (len && unshare_range(f, off / blockSize, cowEnd) < 0) {
+        truncate_extents(f, oldCount);
+        return -1;
+    }
+    if (end > f->contentBytes) f->contentBytes = end;
+
+    // copy extent by extent
+    uint64_t pos = off;
+    int e = len ? find_extent(f, off / blockSize) : 0;
+    while (pos < end) {
+        Extent *x = &f->extents[e++];
+        uint64_t xEnd = (x->logical + x->len) * blockSize;
+        uint64_t chunk = (end < xEnd ? end : xEnd) - pos;
+        uint64_t lb = pos / blockSize;
+
+        unsigned char *p = cache_run(x->start + (lb - x->logical), (pos + chunk - 1) / blockSize - lb + 1, 1);
+        memcpy(p + pos % blockSize, data + (pos - off), chunk);
+        pos += chunk;
+    }
+    return 0;
+}
+
+// Bring the inode up to date after filling bytes [from, to); on failure
+// (no room for map blocks) the file is cut back to its old size.
+// Returns -1 if so.
+int commit_file_growth(FSNode *f, uint64_t oldCount, uint64_t oldBytes, uint64_t from, uint64_t to) {
+    if (to > from) dedup_range(f, from / blockSize, (to + blockSize - 1) / blockSize);
+    if (f->blockCount == oldCount && !f->mapDirty) {
+        DiskInode *d = inode_w(f->ino);
+        account_tree(f->ino, (int64_t)(f->contentBytes - d->contentBytes), 0);
+        store_content_bytes(f->ino, d, f->contentBytes);
+        return 0;
+    }
+    if (store_file_map(f) < 0) {
+        truncate_extents(f, oldCount);
+        f->contentBytes = oldBytes;
+        store_file_map(f);
+        return -1;
+    }
+    return 0;
+}
+
+// Write 'len' bytes at 'off', growing the file if needed.
+// Returns -1 if the disk is full.
+int write_file_range(FSNode *f, uint64_t off, const char *data, size_t len) {
+    load_file_map(f);
+    int r;
+    if (fits_inline(f, off + len)) {
+        inline_write(f, off, data, len);
+        r = 0;
+    } else if (f->compressed) {
+        r = packed_write(f, off, data, len);
+    } else if (uninline_file(f) < 0) {
+        return -1;
+    } else {
+        uint64_t oldCount = f->blockCount, oldBytes = f->contentBytes;
+        if (fill_file_range(f, off, data, len) < 0) {
+            store_file_map(f);          // copy-on-write may have remapped blocks
+            return -1;
+        }
+        // a gap grown before 'off' is zeros: worth sharing too
+        r = commit_file_growth(f, oldCount, oldBytes, off < oldBytes ? off : oldBytes, off + len);
+    }
+    if (r == 0) {
+        COUNT(bytesWritten, len);
+        touch_inode(f->ino);
+    }
+    return r;
+}
+
+// A stream that needs blocks freed by the open transaction may make
+// ensure_free_blocks commit early; store the map first so that commit
+// sees an inode that matches the bitmap.
+int prepare_grow(FSNode *f, uint64_t more) {
+    if (more > __atomic_load_n(&freeBlockCount, __ATOMIC_RELAXED) && tx_pending())
+        return store_file_map(f);
+    return 0;
+}
+
+// Append everything in 'data' at *pos as part of a stream; a compressed
+// file's stream goes through its writer 'w'
+int stream_fill(FSNode *f, GroupWriter *w, uint64_t *pos, const char *data, size_t len) {
+    if (f->compressed) {
+        if (gw_write(w, *pos, data, len) < 0) return -1;
+        *pos += len;
+        return 0;
+    }
+    uint64_t needed = (*pos + len + blockSize - 1) / blockSize;
+    if (needed > f->blockCount && prepare_grow(f, needed - f->blockCount) < 0) return -1;
+    if (fill_file_range(f, *pos, data, len) < 0) return -1;
+    *pos += len;
+    return 0;
+}
+
+#define IMPORT_CHUNK 256   // blocks per read(); also the growth step when the size is unknown
+
+// Read fd to EOF straight into the file's blocks at the end of its
+// contents. Returns 0, -1 if the disk filled up, or -2 on a read error.
+int import_fd(FSNode *f, int fd, uint64_t sizeHint) {
+    uint64_t pos = f->contentBytes;
+    while (1) {
+        if (pos == f->blockCount * blockSize) {
+            uint64_t more = sizeHint > pos ? (sizeHint - pos + blockSize - 1) / blockSize : IMPORT_CHUNK;
+            if (prepare_grow(f, more) < 0) return -1;
+            if (!ensure_free_blocks(more)) {
+                more = __atomic_load_n(&freeBlockCount, __ATOMIC_RELAXED);
+                if (more == 0) return -1;
+            }
+            // not zeroed: every byte is read into, and the tail is cleared below
+            if (grow_file(f, more, 0) == 0) return -1;
+        }
+
+        uint64_t lb = pos / blockSize;
+        Extent *x = &f->extents[find_extent(f, lb)];
+        uint64_t n = x->logical + x->len - lb;
+        if (n > IMPORT_CHUNK) n = IMPORT_CHUNK;
+        unsigned char *dst = cache_run(x->start + (lb - x->logical), n, 1);
+
+        ssize_t got = read(fd, dst + pos % blockSize, n * blockSize - pos % blockSize);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return -2;
+        }
+        if (got == 0) break;
+        pos += got;
+        f->contentBytes = pos;
+    }
+
+    // give back blocks grown past the data and zero the rest of the last one
+    truncate_extents(f, (pos + blockSize - 1) / blockSize);
+    if (pos % blockSize) {
+        uint64_t lb = pos / blockSize;
+        Extent *x = &f->extents[find_extent(f, lb)];
+        unsigned char *p = cache_run(x->start + (lb - x->logical), 1, 1);
+        memset(p + pos % blockSize, 0, blockSize - pos % blockSize);
+    }
+    return 0;
+}
+
+// Sequential reads (in logical block order) trigger readahead one
+// window ahead each time they cross a window boundary
+void file_access(FSNode *f, uint64_t lb) {
+    // a hint only: concurrent readers of one file may clobber it
+    uint64_t expect = __atomic_exchange_n(&f->raNext, lb + 1, __ATOMIC_RELAXED);
+    int sequential = lb == expect || lb == 0;
+    if (!sequential || lb % raWindow != 0) return;
+
+    uint64_t from = lb + 1, end = from + raWindow;
+    if (end > f->blockCount) end = f->blockCount;
+    if (from >= end) return;
+
+    // each extent piece in the window is one physical run
+    for (int e = find_extent(f, from); from < end; e++) {
+        Extent *x = &f->extents[e];
+        uint64_t xEnd = x->logical + x->len;
+        uint64_t n = (end < xEnd ? end : xEnd) - from;
+        cache_readahead(x->start + (from - x->logical), n);
+        from += n;
+    }
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+int writev_all(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) return -1;
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Send bytes [off, off+len) of a file to fd. Each extent is one
+// physically contiguous run; runs go out with writev in batches of
+// IOV_MAX, or with sendfile straight from the image when zeroCopy is set
+// and the disk is file-backed. When out is set the runs are fwritten
+// through its buffer instead and fd is unused. Returns -1 on a write
+// error.
+int send_file_range(FSNode *f, uint64_t off, uint64_t len, int fd, FILE *out, int zeroCopy) {
+    load_file_map(f);
+    if (len == 0) return 0;
+    COUNT(bytesRead, len);
+    if (f->inlined) return put_bytes(fd, out, inline_bytes(f->ino) + off, len);
+    if (f->compressed) return send_packed_range(f, off, len, fd, out);
+    zeroCopy = zeroCopy && imageFd >= 0 && !out;
+
+    // runs go through the cache a readahead window at a time, and a
+    // batch is written out before it outgrows half a cache shard, so its
+    // frames are still resident when writev copies them
+    struct iovec iov[IOV_MAX];
+    int cnt = 0;
+    uint64_t pos = off, end = off + len, batchBytes = 0;
+    uint64_t batchMax = cacheFrames ? (uint64_t)(cacheFrames / cacheShardCount) * frameBytes / 2 : UINT64_MAX;
+    if (batchMax < raWindow * blockSize) batchMax = raWindow * blockSize;
+
+    for (int e = find_extent(f, off / blockSize); pos < end; ) {
+        Extent *x = &f->extents[e];
+        uint64_t xEnd = (x->logical + x->len) * blockSize;
+        uint64_t wEnd = (pos / blockSize / raWindow + 1) * raWindow * blockSize;
+        if (wEnd < xEnd) xEnd = wEnd;
+        else e++;
+        uint64_t chunk = (end < xEnd ? end : xEnd) - pos;
+        uint64_t lb = pos / blockSize, lbLast = (pos + chunk - 1) / blockSize;
+
+        for (uint64_t k = lb; k <= lbLast; k++) file_access(f, k);
+        unsigned char *p = cache_run(x->start + (lb - x->logical), lbLast - lb + 1, 0) + pos % blockSize;
+
+        if (out) {
+            if (fwrite(p, 1, chunk, out) != chunk) return -1;
+        } else if (zeroCopy) {
+            off_t src = super->dataOff + (p - diskMemory);
+            uint64_t remain = chunk;
+            while (remain > 0) {
+                ssize_t n = sendfile(fd, imageFd, &src, remain);
+                if (n <= 0) return -1;
+                remain -= n;
+            }
+        } else {
+            iov[cnt].iov_base = p;
+            iov[cnt].iov_len = chunk;
+            batchBytes += chunk;
+            if (++cnt == IOV_MAX || batchBytes >= batchMax) {
+                if (writev_all(fd, iov, cnt) < 0) return -1;
+                cnt = 0;
+                batchBytes = 0;
+            }
+        }
+        pos += chunk;
+    }
+    if (cnt && writev_all(fd, iov, cnt) < 0) return -1;
+    return 0;
+}
+
+// Print bytes [off, off+len) of a file. A socket session's output is
+// flushed after every command anyway, so its runs skip the stdio copy
+// and go out with writev; elsewhere (--batch above all) they stay in
+// the session's buffer.
+void print_file_range(VfsSession *s, FSNode *f, uint64_t off, uint64_t len) {
+    if (s->remote) {
+        fflush(s->out);
+        send_file_range(f, off, len, fileno(s->out), NULL, 0);
+    } else {
+        send_file_range(f, off, len, -1, s->out, 0);
+    }
+}
+
+// Resolve a path that must name a regular file, printing why not
+FSNode *lookup_file(VfsSession *s, const char *path) {
+    FSNode *f = resolve_path(s->cwd, path);
+    if (!f) {
+        fprintf(s->out, "Not found.\n");
+        return NULL;
+    }
+    if (f->isDirectory) {
+        fprintf(s->out, "'%s' is a directory.\n", path);
+        return NULL;
+    }
+    return f;
+}
+
+void do_write(VfsSession *s, char *path, char *text, size_t len) {
+    FSNode *f = resolve_path(s->cwd, path);
+    if (!f) {
+        fprintf(s->out, "File not found.\n");
+        return;
+    }
+    if (f->isDirectory) {
+        fprintf(s->out, "Can't write to directory.\n");
+        return;
+    }
+    pthread_rwlock_wrlock(&f->lock);
+    write_file_data(s, f, text, len);
+    pthread_rwlock_unlock(&f->lock);
+}
+
+void do_read(VfsSession *s, char *path) {
+    if (!path) {
+        fprintf(s->out, "Usage: read <file>\n");
+        return;
+    }
+    FSNode *f = resolve_path(s->cwd, path);
+    if (!f) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (f->isDirectory) {
+        fprintf(s->out, "'%s' is a directory.\n", path);
+        return;
+    }
+    pthread_rwlock_rdlock(&f->lock);
+    if (f->contentBytes == 0) {
+        fprintf(s->out, "(empty)\n");
+    } else {
+        print_file_range(s, f, 0, f->contentBytes);
+        fputc('\n', s->out);
+    }
+    pthread_rwlock_unlock(&f->lock);
+}
+
+void do_export(VfsSession *s, char *path, char *hostPath) {
+    if (!path || !hostPath) {
+        fprintf(s->out, "Usage: export <file> <hostpath>\n");
+        return;
+    }
+    // host paths are the server's, not the client's to name
+    if (s->remote) {
+        fprintf(s->out, "Export is not available over the socket.\n");
+        return;
+    }
+    FSNode *f = lookup_file(s, path);
+    if (!f) return;
+
+    int fd = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(hostPath);
+        return;
+    }
+    pthread_rwlock_rdlock(&f->lock);
+    uint64_t bytes = f->contentBytes;
+    int r = send_file_range(f, 0, bytes, fd, NULL, 1);
+    pthread_rwlock_unlock(&f->lock);
+    close(fd);
+    if (r < 0) {
+        perror(hostPath);
+        return;
+    }
+    fprintf(s->out, "Exported %llu bytes to %s.\n", (unsigned long long)bytes, hostPath);
+}
+
+// Replace a file's contents with a host file, read straight into its blocks
+void do_import(VfsSession *s, char *path, char *hostPath) {
+    if (!path || !hostPath) {
+        fprintf(s->out, "Usage: import <file> <hostpath>\n");
+        return;
+    }
+    // host paths are the server's, not the client's to name
+    if (s->remote) {
+        fprintf(s->out, "Import is not available over the socket.\n");
+        return;
+    }
+    FSNode *f = lookup_file(s, path);
+    if (!f) return;
+
+    int fd = open(hostPath, O_RDONLY);
+    if (fd < 0) {
+        perror(hostPath);
+        return;
+    }
+    struct stat st;
+    uint64_t hint = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0;
+
+    pthread_rwlock_wrlock(&f->lock);
+    load_file_map(f);
+    release_file_data(f);
+    store_file_map(f);
+    int r = f->compressed ? packed_import(f, fd) : import_fd(f, fd, hint);
+    int err = errno;
+    if (r == 0) dedup_range(f, 0, f->blockCount);
+    if (r == 0 && store_file_map(f) < 0) r = -1;
+    if (r < 0) {
+        release_file_data(f);
+        store_file_map(f);
+    }
+    uint64_t bytes = f->contentBytes;
+    pthread_rwlock_unlock(&f->lock);
+    close(fd);
+
+    if (r == -1) fprintf(s->out, "Disk full.\n");
+    else if (r == -2) fprintf(stderr, "%s: %s\n", hostPath, strerror(err));
+    else {
+        COUNT(bytesWritten, bytes);
+        touch_inode(f->ino);
+        fprintf(s->out, "Imported %llu bytes from %s.\n", (unsigned long long)bytes, hostPath);
+    }
+}
+
+void do_append(VfsSession *s, char *path, char *text, size_t len) {
+    FSNode *f = lookup_file(s, path);
+    if (!f) return;
+
+    pthread_rwlock_wrlock(&f->lock);
+    int r = write_file_range(f, f->contentBytes, text, len);
+    pthread_rwlock_unlock(&f->lock);
+    if (r < 0) {
+        fprintf(s->out, "Disk full.\n");
+        return;
+    }
+    fprintf(s->out, "Appended %zu bytes.\n", len);
+}
+
+void do_pwrite(VfsSession *s, char *path, char *offset, char *text, size_t len) {
+    if (!*offset) {
+        fprintf(s->out, "Usage: pwrite <file> <offset> <text>\n");
+        return;
+    }
+    FSNode *f = lookup_file(s, path);
+    if (!f) return;
+
+    long long off = atoll(offset);
+    if (off < 0) {
+        fprintf(s->out, "Invalid offset.\n");
+        return;
+    }
+    pthread_rwlock_wrlock(&f->lock);
+    int r = write_file_range(f, off, text, len);
+    pthread_rwlock_unlock(&f->lock);
+    if (r < 0) {
+        fprintf(s->out, "Disk full.\n");
+        return;
+    }
+    fprintf(s->out, "Written %zu bytes at offset %lld.\n", len, off);
+}
+
+// Next line of a heredoc body, newline stripped; NULL at the delimiter
+// or the end of input
+char *heredoc_line(VfsSession *s, const char *delim, char **buf, size_t *cap, size_t *len) {
+    if (isatty(fileno(s->in))) {
+        fputs("> ", s->out);
+        fflush(s->out);
+    }
+    ssize_t n = getline(buf, cap, s->in);
+    if (n < 0) return NULL;
+    if (n > 0 && (*buf)[n-1] == '\n') (*buf)[--n] = '\0';
+    if (strcmp(*buf, delim) == 0) return NULL;
+    *len = n;
+    return *buf;
+}
+
+#define SPOOL_CHUNK (64 * 1024)   // bytes per read of a spooled heredoc body
+
+// Read a heredoc body up to delim into an unlinked temporary file,
+// rewound for reading. The whole body is consumed even if spooling
+// fails, in which case NULL is returned.
+FILE *spool_heredoc(VfsSession *s, const char *delim) {
+    char *buf = NULL;
+    size_t cap = 0, len;
+    FILE *spool = tmpfile();
+    int first = 1;
+    while (heredoc_line(s, delim, &buf, &cap, &len)) {
+        if (!spool) continue;          // keep draining the body
+        if (!first) fputc('\n', spool);
+        fwrite(buf, 1, len, spool);
+        first = 0;
+    }
+    free(buf);
+    if (spool && (fflush(spool) != 0 || ferror(spool) || fseek(spool, 0, SEEK_SET) != 0)) {
+        fclose(spool);
+        spool = NULL;
+    }
+    if (!spool) fprintf(s->out, "Can't spool the input: %s\n", strerror(errno));
+    return spool;
+}
+
+/* write/append/pwrite <file> [offset] <<DELIM: the input lines up to
+ * DELIM are the content, taken verbatim and joined by newlines (no
+ * trailing newline, like an inline write). handle_input spools the body
+ * before taking any lock, so a slow client never stalls other sessions;
+ * here it is copied into the file's blocks a chunk at a time and the
+ * block map is stored once at the end. Closes body. */
+void do_write_stream(VfsSession *s, const char *cmd, char *path, char *offset, FILE *body) {
+    if (!body) return;
+    FSNode *f = lookup_file(s, path);
+    long long off = 0;
+    if (f && cmd[0] == 'p' && (!*offset || (off = atoll(offset)) < 0)) {
+        fprintf(s->out, "Invalid offset.\n");
+        f = NULL;
+    }
+    if (!f) {
+        fclose(body);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&f->lock);
+    load_file_map(f);
+    if (cmd[0] == 'w') {
+        release_file_data(f);
+        store_file_map(f);
+    }
+    // streams write blocks; an inline file moves its bytes out first
+    int full = uninline_file(f) < 0;
+    uint64_t oldCount = f->blockCount, oldBytes = f->contentBytes;
+    uint64_t start = cmd[0] == 'a' ? f->contentBytes : (uint64_t)off, pos = start;
+    GroupWriter w;
+    if (f->compressed) gw_open(&w, f);
+
+    char *buf = malloc(SPOOL_CHUNK);
+    size_t len;
+    while (!full && (len = fread(buf, 1, SPOOL_CHUNK, body)) > 0)
+        if (stream_fill(f, &w, &pos, buf, len) < 0) full = 1;
+    free(buf);
+    fclose(body);
+
+    if (f->compressed) {
+        if (gw_finish(&w, !full) < 0) full = 1;
+    } else if (full) {
+        truncate_extents(f, oldCount);
+        f->contentBytes = oldBytes;
+        store_file_map(f);
+    } else if (commit_file_growth(f, oldCount, oldBytes, start, pos) < 0) {
+        full = 1;
+    }
+    pthread_rwlock_unlock(&f->lock);
+
+    unsigned long long n = pos - start;
+    if (!full) {
+        COUNT(bytesWritten, n);
+        touch_inode(f->ino);
+    }
+    if (full) fprintf(s->out, "Disk full.\n");
+    else if (cmd[0] == 'w') fprintf(s->out, "Written %llu bytes.\n", n);
+    else if (cmd[0] == 'a') fprintf(s->out, "Appended %llu bytes.\n", n);
+    else fprintf(s->out, "Written %llu bytes at offset %lld.\n", n, off);
+}
+
+// compress <file> [off]: switch a file to compressed storage (or back),
+// re-encoding what it holds. Later writes keep the file's mode.
+void do_compress(VfsSession *s, char *path, char *mode) {
+    if (!path || (mode && strcmp(mode, "off") != 0)) {
+        fprintf(s->out, "Usage: compress <file> [off]\n");
+        return;
+    }
+    FSNode *f = lookup_file(s, path);
+    if (!f) return;
+
+    int on = mode == NULL;
+    pthread_rwlock_wrlock(&f->lock);
+    int r = set_compressed(f, on);
+    unsigned long long bytes = f->contentBytes, blocks = f->blockCount;
+    pthread_rwlock_unlock(&f->lock);
+    if (r < 0) {
+        fprintf(s->out, "Disk full.\n");
+        return;
+    }
+    fprintf(s->out, "%s: %llu bytes in %llu blocks.\n", on ? "Compressed" : "Uncompressed", bytes, blocks);
+}
+
+void do_pread(VfsSession *s, char *path, char *offset, char *length) {
+    if (!path || !offset || !length) {
+        fprintf(s->out, "Usage: pread <file> <offset> <len>\n");
+        return;
+    }
+    FSNode *f = lookup_file(s, path);
+    if (!f) return;
+
+    long long o = atoll(offset), l = atoll(length);
+    if (o < 0 || l < 0) {
+        fprintf(s->out, "Invalid range.\n");
+        return;
+    }
+    uint64_t off = o, len = l;
+    pthread_rwlock_rdlock(&f->lock);
+    if (off > f->contentBytes) off = f->contentBytes;
+    if (len > f->contentBytes - off) len = f->contentBytes - off;
+
+    print_file_range(s, f, off, len);
+    pthread_rwlock_unlock(&f->lock);
+    fputc('\n', s->out);
+}
+
+// delete file
+void do_delete(VfsSession *s, char *path) {
+    if (!path) {
+        fprintf(s->out, "Usage: delete <file>\n");
+        return;
+    }
+    FSNode *f = resolve_path(s->cwd, path);
+    if (!f) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (f->isDirectory) {
+        fprintf(s->out, "Use rmdir.\n");
+        return;
+    }
+    load_file_map(f);
+    release_file_data(f);
+    DiskInode *d = inode_w(f->ino);
+    account_tree(f->ino, -(int64_t)d->contentBytes, -(int64_t)d->blockCount);
+    free_map_chain(d);
+    inode_unlink(f->ino);
+    free_inode(f->ino);
+    detach_child(f->parent, f);
+    free_node(f);
+    fprintf(s->out, "File removed.\n");
+}
+
+void do_rmdir(VfsSession *s, char *path) {
+    if (!path) {
+        fprintf(s->out, "Usage: rmdir <dir>\n");
+        return;
+    }
+    FSNode *d = resolve_path(s->cwd, path);
+    if (!d) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (!d->isDirectory) {
+        fprintf(s->out, "Not a directory.\n");
+        return;
+    }
+    if (!is_loaded(d)) load_dir(d);
+    if (d->child) {
+        fprintf(s->out, "Directory not empty.\n");
+        return;
+    }
+    if (d == rootDir || d == s->cwd) {
+        fprintf(s->out, "Can't remove current directory.\n");
+        return;
+    }
+    if (__atomic_load_n(&d->cwdRefs, __ATOMIC_ACQUIRE) > 0) {
+        fprintf(s->out, "Directory in use.\n");
+        return;
+    }
+    inode_unlink(d->ino);
+    free_inode(d->ino);
+    detach_child(d->parent, d);
+    free_node(d);
+    fprintf(s->out, "Removed dir.\n");
+}
+
+// rm [-r] <path>: remove a file, or with -r a directory tree
+void do_rm(VfsSession *s, int recursive, char *path) {
+    if (!path) {
+        fprintf(s->out, "Usage: rm [-r] <path>\n");
+        return;
+    }
+    FSNode *n = resolve_path(s->cwd, path);
+    if (!n) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (n->isDirectory && !recursive) {
+        fprintf(s->out, "'%s' is a directory (use rm -r).\n", path);
+        return;
+    }
+    if (n == rootDir) {
+        fprintf(s->out, "Can't remove the root directory.\n");
+        return;
+    }
+    if (remove_tree(s, n) < 0) {
+        fprintf(s->out, "Directory in use.\n");
+        return;
+    }
+    fprintf(s->out, "Removed '%s'.\n", path);
+}
+
+void print_usage(VfsSession *s, FSNode *n, const char *label) {
+    const DiskInode *d = &inodeTable[n->ino];
+    fprintf(s->out, "%llu\t%llu\t%s%s\n",
+            (unsigned long long)__atomic_load_n(&d->contentBytes, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&d->blockCount, __ATOMIC_RELAXED),
+            label, n->isDirectory && n != rootDir ? "/" : "");
+}
+
+// du [path]: bytes and data blocks of each entry of a directory, then
+// of the directory itself. Directory figures are the running totals kept
+// in their inodes, so nothing below is visited.
+void do_du(VfsSession *s, char *path) {
+    FSNode *n = path ? resolve_path(s->cwd, path) : s->cwd;
+    if (!n) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (n->isDirectory) {
+        if (!is_loaded(n)) load_dir(n);
+        FSNode *c = n->child;
+        if (c) {
+            do {
+                print_usage(s, c, c->name);
+                c = c->nextSibling;
+            } while (c != n->child);
+        }
+    }
+    print_usage(s, n, path ? path : node_path(n));
+}
+
+// find <pattern> [dir]: paths of everything below dir (default: the
+// working directory) whose name matches a shell pattern
+void do_find(VfsSession *s, char *pattern, char *path) {
+    if (!pattern) {
+        fprintf(s->out, "Usage: find <pattern> [dir]\n");
+        return;
+    }
+    FSNode *dir = path ? resolve_path(s->cwd, path) : s->cwd;
+    if (!dir) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (!dir->isDirectory) {
+        fprintf(s->out, "Not a directory.\n");
+        return;
+    }
+
+    WalkStack w = { 0 };
+    WalkItem it;
+    int found = 0;
+    walk_children(&w, dir, NULL, 1);
+    while (walk_pop(&w, &it)) {
+        if (fnmatch(pattern, it.node->name, 0) == 0) {
+            fprintf(s->out, "%s%s\n", node_path(it.node), it.node->isDirectory ? "/" : "");
+            found++;
+        }
+        if (it.node->isDirectory) walk_children(&w, it.node, NULL, 1);
+    }
+    free(w.items);
+    if (!found) fprintf(s->out, "No matches.\n");
+}
+
+// Path of an inode from the names in the inode table, so query results
+// need no tree loading. Built backwards from the end of buf.
+const char *inode_path(uint32_t ino, char *buf, size_t cap) {
+    size_t pos = cap - 1;
+    buf[pos] = '\0';
+    for (uint32_t i = ino; inodeTable[i].parent != NO_INODE; i = inodeTable[i].parent) {
+        size_t len = strlen(inodeTable[i].name);
+        if (len + 1 > pos) break;
+        pos -= len;
+        memcpy(buf + pos, inodeTable[i].name, len);
+        buf[--pos] = '/';
+    }
+    if (!buf[pos]) buf[--pos] = '/';
+    return buf + pos;
+}
+
+void format_time(int64_t t, char *buf, size_t cap) {
+    time_t tt = (time_t)t;
+    struct tm tm;
+    localtime_r(&tt, &tm);
+    strftime(buf, cap, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+int valid_attr_name(const char *name) {
+    size_t n = strlen(name);
+    if (n == 0 || n > ATTR_NAME_MAX) return 0;
+    for (size_t i = 0; i < n; i++)
+        if (!isalnum((unsigned char)name[i]) && !strchr("._-", name[i])) return 0;
+    return 1;
+}
+
+// stat <path>: size, blocks, mtime and xattrs of a node
+void do_stat(VfsSession *s, char *path) {
+    if (!path) {
+        fprintf(s->out, "Usage: stat <path>\n");
+        return;
+    }
+    FSNode *n = resolve_path(s->cwd, path);
+    if (!n) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    const DiskInode *d = &inodeTable[n->ino];
+    fprintf(s->out, "Type: %s\nSize: %llu\nBlocks: %llu\n", n->isDirectory ? "directory" : "file",
+            (unsigned long long)__atomic_load_n(&d->contentBytes, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&d->blockCount, __ATOMIC_RELAXED));
+    if (!inodeAttrs) return;
+
+    const InodeAttr *a = &inodeAttrs[n->ino];
+    char when[32], name[ATTR_NAME_MAX+1], value[ATTR_VALUE_MAX+1];
+    format_time(__atomic_load_n(&a->mtime, __ATOMIC_RELAXED), when, sizeof(when));
+    fprintf(s->out, "Modified: %s\n", when);
+    uint32_t off = 0;
+    while (xattr_next(a, &off, name, value))
+        fprintf(s->out, "  %s=%s\n", name, value);
+}
+
+// setxattr <path> <name> <value>, rmxattr <path> <name> (value NULL)
+void do_setxattr(VfsSession *s, char *path, char *name, char *value, int remove) {
+    if (!path || !name || (!remove && !value)) {
+        fprintf(s->out, remove ? "Usage: rmxattr <path> <name>\n"
+                               : "Usage: setxattr <path> <name> <value>\n");
+        return;
+    }
+    if (!inodeAttrs) {
+        fprintf(s->out, "This image has no attribute table.\n");
+        return;
+    }
+    FSNode *n = resolve_path(s->cwd, path);
+    if (!n) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (!valid_attr_name(name)) {
+        fprintf(s->out, "Invalid attribute name.\n");
+        return;
+    }
+    if (value && strlen(value) > ATTR_VALUE_MAX) {
+        fprintf(s->out, "Value too long.\n");
+        return;
+    }
+
+    int r = update_xattr(n->ino, name, remove ? NULL : value);
+    if (r == -1) fprintf(s->out, "Disk full.\n");
+    else if (r == -2) fprintf(s->out, "Attributes don't fit in a block.\n");
+    else if (r == -3) fprintf(s->out, "No such attribute.\n");
+    else fprintf(s->out, remove ? "Attribute removed.\n" : "Attribute set.\n");
+}
+
+// getxattr <path> [name]: one value, or every name=value
+void do_getxattr(VfsSession *s, char *path, char *name) {
+    if (!path) {
+        fprintf(s->out, "Usage: getxattr <path> [name]\n");
+        return;
+    }
+    if (!inodeAttrs) {
+        fprintf(s->out, "This image has no attribute table.\n");
+        return;
+    }
+    FSNode *n = resolve_path(s->cwd, path);
+    if (!n) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+
+    char value[ATTR_VALUE_MAX+1];
+    if (name) {
+        if (get_xattr(n->ino, name, value) < 0) fprintf(s->out, "No such attribute.\n");
+        else fprintf(s->out, "%s\n", value);
+        return;
+    }
+    const InodeAttr *a = &inodeAttrs[n->ino];
+    char an[ATTR_NAME_MAX+1];
+    uint32_t off = 0;
+    while (xattr_next(a, &off, an, value))
+        fprintf(s->out, "%s=%s\n", an, value);
+    if (!a->xattrCount) fprintf(s->out, "No attributes.\n");
+}
+
+/* query <cond>...: nodes matching every condition, answered from the
+ * indexes. A condition is size<op><bytes> (K, M, G, T suffixes; files
+ * only), mtime<op><time> (epoch seconds, YYYY-MM-DD, "today" or -N with
+ * s/m/h/d for "N ago"), or <xattr>=<value> with "*" for any value. <op>
+ * is one of < <= > >= =. The condition matching the fewest entries picks
+ * the index to scan; the others are checked per candidate. */
+#define QUERY_MAX_TERMS 8
+#define QUERY_SIZE      0
+#define QUERY_MTIME     1
+#define QUERY_XATTR     2
+
+typedef struct {
+    int field;
+    uint64_t min, max;         // size, mtime: inclusive
+    char name[ATTR_NAME_MAX+1];
+    char value[ATTR_VALUE_MAX+1];   // "*": any value
+    char lo[ATTR_NAME_MAX + ATTR_VALUE_MAX + 2], hi[ATTR_NAME_MAX + ATTR_VALUE_MAX + 2];
+    IndexNode **index;
+    IndexKey from, to;         // entries in [from, to) match
+} QueryTerm;
+
+int parse_size(const char *p, uint64_t *v) {
+    char *end;
+    if (!isdigit((unsigned char)*p)) return -1;
+    *v = strtoull(p, &end, 10);
+    const char *units = "KMGT";
+    const char *u = *end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+    if (u) {
+        *v <<= 10 * (u - units + 1);
+        end++;
+    }
+    return *end ? -1 : 0;
+}
+
+int parse_time(const char *p, int64_t *t) {
+    time_t now = time(NULL);
+    struct tm tm;
+    int y, m, d;
+    char *end;
+    if (strcmp(p, "today") == 0) {
+        localtime_r(&now, &tm);
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+        *t = mktime(&tm);
+        return 0;
+    }
+    if (sscanf(p, "%4d-%2d-%2d", &y, &m, &d) == 3 && strlen(p) == 10) {
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_year = y - 1900;
+        tm.tm_mon = m - 1;
+        tm.tm_mday = d;
+        tm.tm_isdst = -1;
+        *t = mktime(&tm);
+        return 0;
+    }
+    if (*p == '-') {
+        long long n = strtoll(p + 1, &end, 10);
+        const char *units = "smhd";
+        static const int secs[] = { 1, 60, 3600, 86400 };
+        const char *u = *end ? strchr(units, *end) : NULL;
+        if (end == p + 1 || n < 0 || !u || end[1]) return -1;
+        *t = now - n * secs[u - units];
+        return 0;
+    }
+    if (!isdigit((unsigned char)*p)) return -1;
+    *t = strtoll(p, &end, 10);
+    return *end ? -1 : 0;
+}
+
+// Returns 0, 1 if the condition can match nothing, -1 if it is invalid
+int parse_term(const char *text, QueryTerm *q) {
+    size_t n = strcspn(text, "<>=");
+    if (n == 0 || n > ATTR_NAME_MAX || !text[n]) return -1;
+    memcpy(q->name, text, n);
+    q->name[n] = '\0';
+    const char *op = text + n, *val = op + 1;
+    if ((op[0] == '<' || op[0] == '>') && op[1] == '=') val++;
+
+    if (strcmp(q->name, "size") == 0 || strcmp(q->name, "mtime") == 0) {
+        uint64_t v;
+        int64_t t;
+        q->field = q->name[0] == 's' ? QUERY_SIZE : QUERY_MTIME;
+        if (q->field == QUERY_SIZE && parse_size(val, &v) < 0) return -1;
+        if (q->field == QUERY_MTIME) {
+            if (parse_time(val, &t) < 0) return -1;
+            v = t < 0 ? 0 : (uint64_t)t;
+        }
+        q->min = 0;
+        q->max = UINT64_MAX;
+        if (op[0] == '=') {
+            q->min = q->max = v;
+        } else if (op[0] == '<') {
+            if (val == op + 1 && v == 0) return 1;
+            q->max = val == op + 1 ? v - 1 : v;
+        } else {
+            if (val == op + 1 && v == UINT64_MAX) return 1;
+            q->min = val == op + 1 ? v + 1 : v;
+        }
+        q->index = q->field == QUERY_SIZE ? &sizeIndex : &mtimeIndex;
+        q->from = (IndexKey){ NULL, q->min, 0 };
+        q->to = (IndexKey){ NULL, q->max, NO_INODE };
+        return 0;
+    }
+
+    if (op[0] != '=' || !valid_attr_name(q->name) || strlen(val) > ATTR_VALUE_MAX) return -1;
+    q->field = QUERY_XATTR;
+    strcpy(q->value, val);
+    q->index = &xattrIndex;
+    if (strcmp(val, "*") == 0) {
+        // every "name=..." sorts between "name=" and "name>"
+        snprintf(q->lo, sizeof(q->lo), "%s=", q->name);
+        snprintf(q->hi, sizeof(q->hi), "%s>", q->name);
+        q->from = (IndexKey){ q->lo, 0, 0 };
+        q->to = (IndexKey){ q->hi, 0, 0 };
+    } else {
+        snprintf(q->lo, sizeof(q->lo), "%s=%s", q->name, val);
+        q->from = (IndexKey){ q->lo, 0, 0 };
+        q->to = (IndexKey){ q->lo, 0, NO_INODE };
+    }
+    return 0;
+}
+
+int term_matches(const QueryTerm *q, uint32_t ino) {
+    const DiskInode *d = &inodeTable[ino];
+    uint64_t v;
+    char value[ATTR_VALUE_MAX+1];
+    switch (q->field) {
+    case QUERY_SIZE:
+        if (d->flags & INODE_DIR) return 0;
+        v = __atomic_load_n(&d->contentBytes, __ATOMIC_RELAXED);
+        return v >= q->min && v <= q->max;
+    case QUERY_MTIME:
+        v = (uint64_t)__atomic_load_n(&inodeAttrs[ino].mtime, __ATOMIC_RELAXED);
+        return v >= q->min && v <= q->max;
+    default:
+        return get_xattr(ino, q->name, value) == 0 &&
+               (strcmp(q->value, "*") == 0 || strcmp(q->value, value) == 0);
+    }
+}
+
+void do_query(VfsSession *s, char **terms, int count) {
+    if (count == 0) {
+        fprintf(s->out, "Usage: query <cond>... (size>1M, mtime>=today, <xattr>=<value>)\n");
+        return;
+    }
+    if (!inodeAttrs) {
+        fprintf(s->out, "This image has no attribute table.\n");
+        return;
+    }
+    QueryTerm q[QUERY_MAX_TERMS];
+    for (int i = 0; i < count; i++) {
+        int r = parse_term(terms[i], &q[i]);
+        if (r < 0) {
+            fprintf(s->out, "Invalid condition: %s\n", terms[i]);
+            return;
+        }
+        if (r > 0) {
+            fprintf(s->out, "No matches.\n");
+            return;
+        }
+    }
+
+    build_indexes();
+    pthread_mutex_lock(&indexLock);
+    int best = 0;
+    uint64_t fewest = UINT64_MAX;
+    for (int i = 0; i < count; i++) {
+        IndexNode *root = *q[i].index;
+        uint64_t n = index_rank(root, &q[i].to) - index_rank(root, &q[i].from);
+        if (n < fewest) {
+            fewest = n;
+            best = i;
+        }
+    }
+    uint32_t *inos = malloc(sizeof(uint32_t) * (fewest ? fewest : 1));
+    uint64_t found = 0;
+    index_collect(*q[best].index, &q[best].from, &q[best].to, inos, &found);
+    pthread_mutex_unlock(&indexLock);
+
+    // candidates are rechecked in full: a writer may have moved on since
+    char buf[4096];
+    uint64_t shown = 0;
+    for (uint64_t k = 0; k < found; k++) {
+        int ok = 1;
+        for (int i = 0; i < count && ok; i++) ok = term_matches(&q[i], inos[k]);
+        if (!ok) continue;
+        fprintf(s->out, "%s%s\n", inode_path(inos[k], buf, sizeof(buf)),
+                inodeTable[inos[k]].flags & INODE_DIR && inos[k] != 0 ? "/" : "");
+        shown++;
+    }
+    free(inos);
+    if (!shown) fprintf(s->out, "No matches.\n");
+}
+
+// defrag [<blocks/s> | off]: start the background defragmenter or set
+// its rate; with no argument, report fragmentation
+void do_defrag(VfsSession *s, char *rate) {
+    if (rate) {
+        char *end;
+        unsigned long long r = strcmp(rate, "off") == 0 ? 0 : strtoull(rate, &end, 10);
+        if (strcmp(rate, "off") != 0 && (*end || r == 0)) {
+            fprintf(s->out, "Usage: defrag [<blocks/s> | off]\n");
+            return;
+        }
+        set_defrag_rate(r);
+        if (r) fprintf(s->out, "Defragmenting at %llu blocks/s.\n", r);
+        else fprintf(s->out, "Defragmenter paused.\n");
+        return;
+    }
+
+    FragReport r;
+    measure_fragmentation(&r);
+    fprintf(s->out, "Files: %llu, %llu in more than one extent (%.2f%%)\n",
+            (unsigned long long)r.files, (unsigned long long)r.fragmented,
+            r.files ? 100.0 * r.fragmented / r.files : 0.0);
+    fprintf(s->out, "Extents per file: %.2f\n", r.files ? (double)r.extents / r.files : 0.0);
+    fprintf(s->out, "Free space: %llu blocks in %llu runs, largest %llu (%.2f%% fragmented)\n",
+            (unsigned long long)r.freeBlocks, (unsigned long long)r.freeRuns,
+            (unsigned long long)r.largestFree,
+            r.freeBlocks ? 100.0 * (1.0 - (double)r.largestFree / r.freeBlocks) : 0.0);
+    pthread_mutex_lock(&defragMutex);
+    if (defragRunning && defragRate)
+        fprintf(s->out, "Defragmenter: %llu blocks/s\n", (unsigned long long)defragRate);
+    else
+        fprintf(s->out, "Defragmenter: off\n");
+    pthread_mutex_unlock(&defragMutex);
+}
+
+// cd
+void do_cd(VfsSession *s, char *path) {
+    if (!path) {
+        fprintf(s->out, "Usage: cd <dir>\n");
+        return;
+    }
+    FSNode *d = resolve_path(s->cwd, path);
+    if (!d) {
+        fprintf(s->out, "Not found.\n");
+        return;
+    }
+    if (!d->isDirectory) {
+        fprintf(s->out, "Not a dir.\n");
+        return;
+    }
+    // a directory can't be removed while it is some session's cwd
+    __atomic_add_fetch(&d->cwdRefs, 1, __ATOMIC_ACQ_REL);
+    __atomic_sub_fetch(&s->cwd->cwdRefs, 1, __ATOMIC_ACQ_REL);
+    s->cwd = d;
+    fprintf(s->out, "Moved to %s\n", node_path(s->cwd));
+}
+
+void do_pwd(VfsSession *s) {
+    fprintf(s->out, "%s\n", node_path(s->cwd));
+}
+
+void do_df(VfsSession *s) {
+    uint64_t freeBlocks = __atomic_load_n(&freeBlockCount, __ATOMIC_RELAXED);
+    uint64_t used = TOTAL_BLOCKS - freeBlocks;
+    double usage = (double)used / TOTAL_BLOCKS * 100.0;
+    fprintf(s->out, "Total: %llu\nUsed: %llu\nFree: %llu\nUsage: %.2f%%\n",
+            (unsigned long long)TOTAL_BLOCKS, (unsigned long long)used,
+            (unsigned long long)freeBlocks, usage);
+    if (sharingEnabled) {
+        // logical counts every file's reference; physical is what is allocated
+        uint64_t shared = __atomic_load_n(&sharedRefs, __ATOMIC_RELAXED);
+        fprintf(s->out, "Logical: %llu\nPhysical: %llu\n%s ratio: %.2fx\n",
+                (unsigned long long)(used + shared), (unsigned long long)used,
+                dedupEnabled ? "Dedup" : "Sharing", used ? (double)(used + shared) / used : 1.0);
+    }
+    fprintf(s->out, "Block size: %u\n", blockSize);
+    fprintf(s->out, "Inodes: %u free of %u\n", super->freeInodes, super->inodeCount);
+}
+
+void do_stats(VfsSession *s) {
+    long long hits = 0, misses = 0, readahead = 0, writebacks = 0;
+    for (int k = 0; cacheFrames && k < cacheShardCount; k++) {
+        CacheShard *sh = &cacheShards[k];
+        pthread_mutex_lock(&sh->lock);
+        hits += sh->hits;
+        misses += sh->misses;
+        readahead += sh->readahead;
+        writebacks += sh->writebacks;
+        pthread_mutex_unlock(&sh->lock);
+    }
+    long long total = hits + misses;
+    if (!cacheFrames)
+        fprintf(s->out, "Cache: off (in-memory disk)\n");
+    else
+        fprintf(s->out, "Cache: %d frames of %zu bytes in %d shards\nHits: %lld\nMisses: %lld\n"
+                "Hit rate: %.2f%%\nReadahead: %lld frames\nWritebacks: %lld\n", cacheFrames, frameBytes,
+                cacheShardCount, hits, misses, total ? 100.0 * hits / total : 0.0, readahead, writebacks);
+
+    pthread_mutex_lock(&slabLock);
+    fprintf(s->out, "Nodes: %lld in %lld slabs\nNames: %llu interned, %llu bytes\n",
+            nodesLive, slabCount, (unsigned long long)nameCount, (unsigned long long)nameBytes);
+    pthread_mutex_unlock(&slabLock);
+    VfsCounters c;
+    snapshot_counters(&c);
+    fprintf(s->out, "Allocations: %lld (%lld failed)\nBlocks allocated: %lld\nBlocks freed: %lld\n",
+            c.allocCalls, c.allocFails, c.blocksAllocated, c.blocksFreed);
+    fprintf(s->out, "Path lookups: %lld\nDentry cache: %lld hits, %lld misses\nChild lookups: %lld\n",
+            c.pathLookups, c.dcacheHits, c.dcacheMisses, c.childLookups);
+    fprintf(s->out, "Bytes written: %lld\nBytes read: %lld\nCommits: %lld (%lld journal bytes)\n",
+            c.bytesWritten, c.bytesRead, c.commits, c.journalWritten);
+    fprintf(s->out, "Defrag: %lld blocks in %lld moves\n", c.defragBlocks, c.defragMoves);
+    fprintf(s->out, "Groups packed: %lld\nGroups unpacked: %lld\n",
+            __atomic_load_n(&groupsPacked, __ATOMIC_RELAXED),
+            __atomic_load_n(&groupsUnpacked, __ATOMIC_RELAXED));
+
+    pthread_mutex_lock(&indexLock);
+    if (indexReady)
+        fprintf(s->out, "Query index: %llu sizes, %llu mtimes, %llu xattrs\n",
+                (unsigned long long)index_count(sizeIndex), (unsigned long long)index_count(mtimeIndex),
+                (unsigned long long)index_count(xattrIndex));
+    pthread_mutex_unlock(&indexLock);
+
+    if (dedupEnabled) {
+        pthread_mutex_lock(&dedupLock);
+        fprintf(s->out, "Dedup hits: %lld\nIndexed blocks: %llu\n",
+                dedupHits, (unsigned long long)dedupIndexCount);
+        pthread_mutex_unlock(&dedupLock);
+    }
+}
+
+void do_sync(VfsSession *s) {
+    sync_image();
+    fprintf(s->out, "Synced.\n");
+}
+
+// Unmount: release the in-memory tree and close the image. Called once
+// every session is gone (or, for the server, can no longer run commands).
+void vfs_shutdown() {
+    stop_defrag();
+    stop_committer();
+    // the tree is not walked: every node lives in the slabs
+    release_node_slabs();
+    rootDir = NULL;
+    free_indexes();
+    free_block_cache();
+    close_image();
+    printf("Goodbye.\n");
+}
+
+/* ---------------- Parsing helpers ---------------- */
+
+// Copy the next whitespace-delimited word at *pp into buf and advance
+void next_word(char **pp, char *buf, int size) {
+    char *p = *pp;
+    while (*p && isspace((unsigned char)*p)) p++;
+    int i = 0;
+    while (*p && !isspace((unsigned char)*p) && i < size - 1)
+        buf[i++] = *p++;
+    buf[i] = '\0';
+    *pp = p;
+}
+
+// Turn the rest of a command line into file content, in place: strip
+// the newline and surrounding quotes, interpret \n. One pass; the text
+// only ever shrinks. Returns the start of the text, its length in *len.
+char *parse_text(char *p, size_t *len) {
+    while (*p && isspace((unsigned char)*p)) p++;
+
+    size_t L = strlen(p);
+    if (L > 0 && p[L-1] == '\n')
+        p[--L] = '\0';
+    if (L >= 2 && ((p[0] == '"' && p[L-1] == '"') || (p[0] == '\'' && p[L-1] == '\''))) {
+        p[--L] = '\0';
+        p++;
+        L--;
+    }
+
+    // interpret only \n
+    size_t o = 0;
+    for (size_t k = 0; k < L; k++) {
+        if (p[k] == '\\' && p[k+1] == 'n') {
+            p[o++] = '\n';
+            k++;
+        } else p[o++] = p[k];
+    }
+    p[o] = '\0';
+    *len = o;
+    return p;
+}
+
+// Run one command line. The line is parsed in place; a heredoc write
+// reads its body from the session's input before locking anything.
+void handle_input(VfsSession *s, char *line) {
+    char *p = line, cmd[16];
+    next_word(&p, cmd, sizeof(cmd));
+    if (!cmd[0]) return;
+
+    // these take their own locks
+    if (strcmp(cmd, "sync") == 0) {
+        do_sync(s);
+        return;
+    }
+    if (strcmp(cmd, "exit") == 0) {
+        s->closing = 1;
+        return;
+    }
+
+    int takesText = strcmp(cmd, "write") == 0 || strcmp(cmd, "append") == 0 ||
+                    strcmp(cmd, "pwrite") == 0;
+    char *save = NULL;
+    char *arg = takesText ? NULL : strtok_r(p, " \t\n", &save);
+
+    // a client may stall mid-body; it must not do so holding txLock
+    char filename[4096] = "", offset[32] = "";
+    FILE *body = NULL;
+    int heredoc = 0;
+    if (takesText) {
+        next_word(&p, filename, sizeof(filename));
+        if (cmd[0] == 'p') next_word(&p, offset, sizeof(offset));
+
+        while (*p && isspace((unsigned char)*p)) p++;
+        if (strncmp(p, "<<", 2) == 0) {
+            char delim[64];
+            p += 2;
+            next_word(&p, delim, sizeof(delim));
+            body = spool_heredoc(s, delim[0] ? delim : "EOF");
+            heredoc = 1;
+        }
+    }
+
+    int exclusive = strcmp(cmd, "mkdir") == 0 || strcmp(cmd, "create") == 0 ||
+                    strcmp(cmd, "delete") == 0 || strcmp(cmd, "rmdir") == 0 ||
+                    strcmp(cmd, "cp") == 0 || strcmp(cmd, "snapshot") == 0 ||
+                    strcmp(cmd, "rm") == 0 || strcmp(cmd, "setxattr") == 0 ||
+                    strcmp(cmd, "rmxattr") == 0;
+    pthread_rwlock_rdlock(&txLock);
+    if (exclusive) pthread_rwlock_wrlock(&nsLock);
+    else pthread_rwlock_rdlock(&nsLock);
+
+    if (strcmp(cmd, "mkdir") == 0) {
+        do_mkdir(s, arg);
+    }
+    else if (strcmp(cmd, "create") == 0) {
+        do_create(s, arg);
+    }
+    else if (strcmp(cmd, "ls") == 0) {
+        do_ls(s, arg);
+    }
+    else if (strcmp(cmd, "cp") == 0) {
+        int recursive = arg && strcmp(arg, "-r") == 0;
+        if (recursive) arg = strtok_r(NULL, " \t\n", &save);
+        do_cp(s, recursive, arg, strtok_r(NULL, " \t\n", &save));
+    }
+    else if (strcmp(cmd, "snapshot") == 0) {
+        do_snapshot(s, arg);
+    }
+    else if (takesText) {
+        if (heredoc) {
+            do_write_stream(s, cmd, filename, offset, body);
+        } else {
+            size_t len;
+            char *text = parse_text(p, &len);
+            if (cmd[0] == 'w') do_write(s, filename, text, len);
+            else if (cmd[0] == 'a') do_append(s, filename, text, len);
+            else do_pwrite(s, filename, offset, text, len);
+        }
+    }
+    else if (strcmp(cmd, "export") == 0) {
+        do_export(s, arg, strtok_r(NULL, " \t\n", &save));
+    }
+    else if (strcmp(cmd, "import") == 0) {
+        do_import(s, arg, strtok_r(NULL, " \t\n", &save));
+    }
+    else if (strcmp(cmd, "pread") == 0) {
+        char *o = strtok_r(NULL, " \t\n", &save);
+        do_pread(s, arg, o, strtok_r(NULL, " \t\n", &save));
+    }
+    else if (strcmp(cmd, "read") == 0) {
+        do_read(s, arg);
+    }
+    else if (strcmp(cmd, "compress") == 0) {
+        do_compress(s, arg, strtok_r(NULL, " \t\n", &save));
+    }
+    else if (strcmp(cmd, "delete") == 0) {
+        do_delete(s, arg);
+    }
+    else if (strcmp(cmd, "rmdir") == 0) {
+        do_rmdir(s, arg);
+    }
+    else if (strcmp(cmd, "rm") == 0) {
+        int recursive = arg && strcmp(arg, "-r") == 0;
+        if (recursive) arg = strtok_r(NULL, " \t\n", &save);
+        do_rm(s, recursive, arg);
+    }
+    else if (strcmp(cmd, "du") == 0) {
+        do_du(s, arg);
+    }
+    else if (strcmp(cmd, "find") == 0) {
+        do_find(s, arg, strtok_r(NULL, " \t\n", &save));
+    }
+    else if (strcmp(cmd, "stat") == 0) {
+        do_stat(s, arg);
+    }
+    else if (strcmp(cmd, "setxattr") == 0) {
+        char *name = strtok_r(NULL, " \t\n", &save);
+        do_setxattr(s, arg, name, strtok_r(NULL, " \t\n", &save), 0);
+    }
+    else if (strcmp(cmd, "rmxattr") == 0) {
+        do_setxattr(s, arg, strtok_r(NULL, " \t\n", &save), NULL, 1);
+    }
+    else if (strcmp(cmd, "getxattr") == 0) {
+        do_getxattr(s, arg, strtok_r(NULL, " \t\n", &save));
+    }
+    else if (strcmp(cmd, "query") == 0) {
+        char *terms[QUERY_MAX_TERMS];
+        int count = 0;
+        for (char *t = arg; t && count < QUERY_MAX_TERMS; t = strtok_r(NULL, " \t\n", &save))
+            terms[count++] = t;
+        do_query(s, terms, count);
+    }
+    else if (strcmp(cmd, "cd") == 0) {
+        do_cd(s, arg);
+    }
+    else if (strcmp(cmd, "pwd") == 0) {
+        do_pwd(s);
+    }
+    else if (strcmp(cmd, "df") == 0) {
+        do_df(s);
+    }
+    else if (strcmp(cmd, "stats") == 0) {
+        do_stats(s);
+    }
+    else if (strcmp(cmd, "defrag") == 0) {
+        do_defrag(s, arg);
+    }
+    else {
+        fprintf(s->out, "Unknown command: %s\n", cmd);
+    }
+
+    pthread_rwlock_unlock(&nsLock);
+    pthread_rwlock_unlock(&txLock);
+}
+
+// Mount an image file (or an in-memory disk when imagePath is NULL).
+// Block size, block count and inode count only matter when a new image
+// is formatted; an existing image keeps the geometry it was made with.
+int init_vfs(const char *imagePath, uint64_t blocks, uint32_t bsize, uint32_t inodes) {
+    if (blocks < 1) blocks = 1;
+    if (bsize < MIN_BLOCK_SIZE || bsize > MAX_BLOCK_SIZE || (bsize & (bsize - 1))) {
+        printf("Block size must be a power of two in %d..%d.\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
+    blockSize = bsize;
+
+    // commits must not starve behind a steady stream of commands
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&txLock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    for (int i = 0; i < DCACHE_LOCKS; i++)
+        pthread_mutex_init(&dcacheLocks[i], NULL);
+
+    if (open_image(imagePath, blocks, inodes) < 0) return -1;
+    init_block_cache();
+
+    rootDir = node_from_inode(0);
+    return 0;
+}
+
+VfsSession *vfs_open_session(FILE *in, FILE *out) {
+    VfsSession *s = malloc(sizeof(VfsSession));
+    s->cwd = rootDir;
+    s->in = in;
+    s->out = out;
+    s->closing = 0;
+    s->remote = 0;
+    __atomic_add_fetch(&rootDir->cwdRefs, 1, __ATOMIC_ACQ_REL);
+    return s;
+}
+
+void vfs_close_session(VfsSession *s) {
+    __atomic_sub_fetch(&s->cwd->cwdRefs, 1, __ATOMIC_ACQ_REL);
+    free(s);
+}
+
+/* ---------------- Batch mode ---------------- */
+
+/* Runs a command script without prompts, output fully buffered, and
+ * reports per-command latency at the end. Histogram bucket b holds
+ * latencies in [2^(b-1), 2^b) microseconds; bucket 0 is under 1 us. */
+#define BATCH_OUT_BUF (1 << 20)
+#define LAT_BUCKETS   32
+#define MAX_LAT_CMDS  32
+
+typedef struct {
+    char name[16];
+    long long count;
+    long long totalUs;
+    long long maxUs;
+    long long buckets[LAT_BUCKETS];
+} LatencyHist;
+
+LatencyHist latHist[MAX_LAT_CMDS];
+int latCmds = 0;
+
+void record_latency(const char *line, long long us) {
+    char name[16];
+    int n = 0;
+    while (*line && isspace((unsigned char)*line)) line++;
+    while (*line && !isspace((unsigned char)*line) && n < (int)sizeof(name) - 1)
+        name[n++] = *line++;
+    name[n] = '\0';
+    if (n == 0) return;
+
+    LatencyHist *h = NULL;
+    for (int i = 0; i < latCmds && !h; i++)
+        if (strcmp(latHist[i].name, name) == 0) h = &latHist[i];
+    if (!h) {
+        // past the table size everything shares the last row
+        if (latCmds == MAX_LAT_CMDS) {
+            h = &latHist[MAX_LAT_CMDS - 1];
+            strcpy(h->name, "(other)");
+        } else {
+            h = &latHist[latCmds++];
+            strcpy(h->name, name);
+        }
+    }
+
+    int b = us > 0 ? 64 - __builtin_clzll((unsigned long long)us) : 0;
+    if (b >= LAT_BUCKETS) b = LAT_BUCKETS - 1;
+    h->buckets[b]++;
+    h->count++;
+    h->totalUs += us;
+    if (us > h->maxUs) h->maxUs = us;
+}
+
+// Upper bound (us) of the bucket holding the given fraction of samples
+long long latency_percentile(const LatencyHist *h, double frac) {
+    long long want = (long long)(h->count * frac + 0.5), seen = 0;
+    if (want < 1) want = 1;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= want) return 1LL << b;
+    }
+    return h->maxUs;
+}
+
+void print_latency_report(FILE *out, long long commands, long long elapsedUs) {
+    double secs = elapsedUs / 1e6;
+    fprintf(out, "Batch: %lld commands in %.3f s (%.0f/s)\n",
+            commands, secs, secs > 0 ? commands / secs : 0.0);
+
+    for (int i = 0; i < latCmds; i++) {
+        LatencyHist *h = &latHist[i];
+        fprintf(out, "%-8s count %lld  avg %.1f us  p50 <%lld us  p99 <%lld us  max %lld us\n",
+                h->name, h->count, (double)h->totalUs / h->count,
+                latency_percentile(h, 0.50), latency_percentile(h, 0.99), h->maxUs);
+
+        long long peak = 0;
+        for (int b = 0; b < LAT_BUCKETS; b++)
+            if (h->buckets[b] > peak) peak = h->buckets[b];
+        for (int b = 0; b < LAT_BUCKETS; b++) {
+            if (!h->buckets[b]) continue;
+            int bar = (int)(40 * h->buckets[b] / peak);
+            fprintf(out, "  %8lld..%-8lld us %10lld %.*s\n", b ? 1LL << (b - 1) : 0LL,
+                    1LL << b, h->buckets[b], bar ? bar : 1,
+                    "########################################");
+        }
+    }
+}
+
+// Run the commands in 'path' ("-" for stdin). stdout must already be
+// fully buffered (see main).
+int run_batch(const char *path) {
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!in) {
+        perror(path);
+        return 1;
+    }
+
+    VfsSession *s = vfs_open_session(in, stdout);
+    char *line = NULL;
+    size_t cap = 0;
+    long long commands = 0, start = now_us();
+
+    while (!s->closing && getline(&line, &cap, in) >= 0) {
+        long long t0 = now_us();
+        handle_input(s, line);
+        journal_op_done();
+        record_latency(line, now_us() - t0);
+        commands++;
+    }
+    long long elapsed = now_us() - start;
+    free(line);
+    if (in != stdin) fclose(in);
+
+    vfs_close_session(s);
+    vfs_shutdown();
+    fflush(stdout);
+    print_latency_report(stderr, commands, elapsed);
+    return 0;
+}
+
+/* ---------------- Benchmark ---------------- */
+
+/* Drives the command layer through a fixed workload: mkdir over the
+ * fan-out, then create, write, read, deep cd and delete of every file.
+ * Each phase reports ops/s and exact p50/p99 from sorted samples;
+ * command output goes to /dev/null, the report and stats to stdout. */
+typedef struct {
+    long long files;
+    long long size;
+    long long fanout;
+    long long depth;
+} BenchConfig;
+
+BenchConfig bench = {10000, 1024, 100, 64};
+
+int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Run one command through the normal path and return its latency (us).
+// 'line' is consumed: the parser tokenizes it in place.
+long long bench_op(VfsSession *s, char *line) {
+    long long t0 = now_us();
+    handle_input(s, line);
+    journal_op_done();
+    return now_us() - t0;
+}
+
+void bench_report(const char *phase, long long *lat, long long n, long long elapsedUs) {
+    if (n == 0) return;
+    qsort(lat, n, sizeof(long long), cmp_ll);
+    double secs = elapsedUs / 1e6;
+    printf("%-7s %8lld ops %10.0f ops/s  p50 %5lld us  p99 %6lld us  max %7lld us\n",
+           phase, n, secs > 0 ? n / secs : 0.0, lat[(n - 1) / 2],
+           lat[(long long)((n - 1) * 0.99)], lat[n - 1]);
+}
+
+// Blocks needed by the workload, for when no count was given
+uint64_t bench_blocks(uint32_t bsize) {
+    if (bsize == 0) bsize = DEFAULT_BLOCK_SIZE;
+    uint64_t perFile = ((uint64_t)bench.size + bsize - 1) / bsize;
+    return (uint64_t)bench.files * perFile + bench.files / 8 + 1024;
+}
+
+int run_bench() {
+    FILE *sink = fopen("/dev/null", "w");
+    if (!sink) {
+        perror("/dev/null");
+        return 1;
+    }
+    VfsSession *s = vfs_open_session(stdin, sink);
+
+    long long n = bench.files, samples = n > bench.fanout ? n : bench.fanout;
+    long long *lat = malloc(sizeof(long long) * samples);
+    size_t lineCap = (size_t)(bench.size > bench.depth * 2 ? bench.size : bench.depth * 2) + 256;
+    char *line = malloc(lineCap);
+    char *payload = malloc(bench.size + 1);
+    if (!lat || !line || !payload) {
+        printf("Memory allocation failed.\n");
+        return 1;
+    }
+    for (long long i = 0; i < bench.size; i++) payload[i] = 'a' + i % 26;
+    payload[bench.size] = '\0';
+
+    printf("Bench: %lld files of %lld bytes, fan-out %lld, cd depth %lld\n",
+           bench.files, bench.size, bench.fanout, bench.depth);
+
+    long long t;
+    t = now_us();
+    for (long long i = 0; i < bench.fanout; i++) {
+        snprintf(line, lineCap, "mkdir /d%lld", i);
+        lat[i] = bench_op(s, line);
+    }
+    bench_report("mkdir", lat, bench.fanout, now_us() - t);
+
+    t = now_us();
+    for (long long i = 0; i < n; i++) {
+        snprintf(line, lineCap, "create /d%lld/f%lld", i % bench.fanout, i);
+        lat[i] = bench_op(s, line);
+    }
+    bench_report("create", lat, n, now_us() - t);
+
+    t = now_us();
+    for (long long i = 0; i < n; i++) {
+        snprintf(line, lineCap, "write /d%lld/f%lld %s", i % bench.fanout, i, payload);
+        lat[i] = bench_op(s, line);
+    }
+    bench_report("write", lat, n, now_us() - t);
+
+    t = now_us();
+    for (long long i = 0; i < n; i++) {
+        snprintf(line, lineCap, "read /d%lld/f%lld", i % bench.fanout, i);
+        lat[i] = bench_op(s, line);
+    }
+    bench_report("read", lat, n, now_us() - t);
+
+    // build /c/c/.../c untimed, then resolve the whole chain from the root
+    for (long long i = 0; i < bench.depth; i++) {
+        strcpy(line, "mkdir c");
+        bench_op(s, line);
+        strcpy(line, "cd c");
+        bench_op(s, line);
+    }
+    char *deep = malloc(bench.depth * 2 + 1);
+    if (!deep) {
+        printf("Memory allocation failed.\n");
+        return 1;
+    }
+    for (long long i = 0; i < bench.depth; i++) memcpy(deep + i * 2, "/c", 2);
+    deep[bench.depth * 2] = '\0';
+    if (bench.depth > 0) {
+        t = now_us();
+        for (long long i = 0; i < n; i++) {
+            snprintf(line, lineCap, "cd %s", deep);
+            lat[i] = bench_op(s, line);
+        }
+        bench_report("cd", lat, n, now_us() - t);
+    }
+    free(deep);
+    strcpy(line, "cd /");
+    bench_op(s, line);
+
+    t = now_us();
+    for (long long i = 0; i < n; i++) {
+        snprintf(line, lineCap, "delete /d%lld/f%lld", i % bench.fanout, i);
+        lat[i] = bench_op(s, line);
+    }
+    bench_report("delete", lat, n, now_us() - t);
+
+    free(payload);
+    free(line);
+    free(lat);
+    vfs_close_session(s);
+    fclose(sink);
+
+    printf("\n");
+    VfsSession *report = vfs_open_session(stdin, stdout);
+    do_stats(report);
+    vfs_close_session(report);
+    vfs_shutdown();
+    return 0;
+}
+
+/* ---------------- Command server ---------------- */
+
+volatile sig_atomic_t serverStop = 0;
+
+void on_stop_signal(int sig) {
+    (void)sig;
+    serverStop = 1;
+}
+
+// One connection is one session: commands in, one per line, and their
+// output back on the same socket
+void *client_thread(void *arg) {
+    block_stop_signals();
+    int fd = (int)(intptr_t)arg;
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    if (!in || !out) {
+        if (in) fclose(in);
+        else close(fd);
+        return NULL;
+    }
+
+    VfsSession *s = vfs_open_session(in, out);
+    s->remote = 1;
+    char *line = NULL;
+    size_t cap = 0;
+    while (!s->closing && getline(&line, &cap, in) >= 0) {
+        handle_input(s, line);
+        fflush(out);
+        journal_op_done();
+    }
+    free(line);
+    vfs_close_session(s);
+    fclose(out);
+    fclose(in);
+    return NULL;
+}
+
+// Serve sessions on a Unix-domain socket until SIGINT/SIGTERM
+int run_server(const char *sockPath) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockPath) >= sizeof(addr.sun_path)) {
+        printf("Socket path too long.\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, sockPath);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(sockPath);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 64) < 0) {
+        perror(sockPath);
+        close(lfd);
+        return 1;
+    }
+
+    // no SA_RESTART, so a signal interrupts accept()
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    start_committer();
+
+    printf("Serving on %s.\n", sockPath);
+    fflush(stdout);
+
+    while (!serverStop) {
+        int cfd = accept(lfd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        pthread_t t;
+        if (pthread_create(&t, NULL, client_thread, (void *)(intptr_t)cfd) != 0) {
+            close(cfd);
+            continue;
+        }
+        pthread_detach(t);
+    }
+    close(lfd);
+    unlink(sockPath);
+
+    stop_defrag();
+    stop_committer();
+
+    // sessions still connected stop at a command boundary; the tree is
+    // left to process exit
+    pthread_rwlock_wrlock(&txLock);
+    free_block_cache();
+    close_image();
+    printf("Goodbye.\n");
+    return 0;
+}
+
+/* ---------------- main ---------------- */
+
+int main(int argc, char **argv) {
+    uint64_t blocks = 1024;
+    uint32_t bsize = DEFAULT_BLOCK_SIZE, inodes = 0;
+    const char *image = NULL, *sockPath = NULL, *batchPath = NULL;
+    int benchMode = 0, blocksGiven = 0;
+    uint64_t defragArg = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cacheSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--block-size") == 0 && i + 1 < argc) {
+            bsize = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--inodes") == 0 && i + 1 < argc) {
+            inodes = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            dedupEnabled = 1;           // only used when formatting
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            sockPath = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batchPath = argv[++i];
+        } else if (strcmp(argv[i], "--defrag") == 0 && i + 1 < argc) {
+            defragArg = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            benchMode = 1;
+        } else if (strcmp(argv[i], "--bench-files") == 0 && i + 1 < argc) {
+            bench.files = strtoll(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--bench-size") == 0 && i + 1 < argc) {
+            bench.size = strtoll(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--bench-fanout") == 0 && i + 1 < argc) {
+            bench.fanout = strtoll(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--bench-depth") == 0 && i + 1 < argc) {
+            bench.depth = strtoll(argv[++i], NULL, 10);
+        } else {
+            unsigned long long n = strtoull(argv[i], NULL, 10);
+            if (n > 0) {
+                blocks = n;
+                blocksGiven = 1;
             }
-            if (strlen(tmp) == 0) strcpy(tmp, "/");
-            snprintf(prompt, sizeof(prompt), "%s > ", tmp);
         }
+    }
+    if (benchMode) {
+        if (bench.files < 0) bench.files = 0;
+        if (bench.size < 0) bench.size = 0;
+        if (bench.fanout < 1) bench.fanout = 1;
+        if (bench.depth < 0) bench.depth = 0;
+        if (!blocksGiven) blocks = bench_blocks(bsize);
+    }
+    // one large buffer instead of a write per response; set before any output
+    if (batchPath) setvbuf(stdout, NULL, _IOFBF, BATCH_OUT_BUF);
+
+    if (init_vfs(image, blocks, bsize, inodes) < 0) return 1;
+    if (defragArg) set_defrag_rate(defragArg);
+    if (sockPath) return run_server(sockPath);
+    if (batchPath) return run_batch(batchPath);
+    if (benchMode) return run_bench();
+
+    printf("VFS ready. Type 'exit' to quit.\n");
+
+    VfsSession *s = vfs_open_session(stdin, stdout);
+    char *line = NULL;
+    size_t cap = 0;
 
-        printf("%s", prompt);
-        if (!fgets(line, sizeof(line), stdin)) {
+    while (!s->closing) {
+        printf("%s > ", node_path(s->cwd));
+        // an interactive user is about to wait anyway: make work durable
+        if (isatty(STDIN_FILENO)) journal_commit();
+        if (getline(&line, &cap, stdin) < 0) {
             printf("\n");
-            do_exit();
+            break;
         }
-        handle_input(line);
+        handle_input(s, line);
+        journal_op_done();
     }
+    free(line);
+    vfs_close_session(s);
+    vfs_shutdown();
     return 0;
 }
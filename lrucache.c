@@ -1,145 +1,399 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
-#define HASH_SIZE 2003
 #define MAX_VALUE_LEN 100
+#define VALUE_WORDS ((MAX_VALUE_LEN + 7) / 8)
+#define MAX_CAPACITY 1000000
+#define OPTIMISTIC_TRIES 8
 
 int REJECT_DUPLICATES = 0;
 
+// Eviction policy, chosen at createCache. LRU keeps a recency list that
+// every hit reorders; CLOCK only sets the hit node's reference bit and
+// sweeps the pool for an unreferenced node when it needs one, so a hit
+// writes nothing shared: it reads the shard optimistically (see get).
+
+typedef enum { EVICT_LRU, EVICT_CLOCK } EvictPolicy;
+
 typedef struct Node {
     int key;
-    char value[MAX_VALUE_LEN];
+    unsigned char ref;      // CLOCK: hit since the hand last passed (atomic)
+    uint64_t value[VALUE_WORDS];   // NUL-terminated; words accessed atomically
     struct Node *prev, *next;
 } Node;
 
-// HashMap Entry
+// Hash index slot: open addressing with Robin Hood probing. The key and
+// its node sit in the table itself, so inserts and deletes never malloc.
 
-typedef struct Entry {
+typedef struct {
+    Node *node;             // NULL if the slot is empty
     int key;
-    Node *node;
-    struct Entry *next;
-} Entry;
+    unsigned int dist;      // probe distance from the key's home slot
+} Slot;
 
-// LRU Cache Structure
+// Cache Shard: its own lock, recency list and index. Keys are spread
+// over the shards by hash, so threads on different keys rarely meet.
+// Each shard gets its own cache lines.
 
 typedef struct {
+    pthread_rwlock_t lock;  // put, LRU hits; CLOCK hits only as a fallback (shared)
+    unsigned int seq;       // odd while put changes the index or a value
     int capacity, size;
-    Node *head, *tail;
-    Entry *hashMap[HASH_SIZE];
+    Node *head, *tail;      // LRU only
+    Node *pool;             // 'capacity' nodes in one block, handed out in order
+    int hand;               // CLOCK: next pool node the sweep looks at
+    Slot *slots;
+    unsigned int mask;      // slot count - 1, a power of two
+} __attribute__((aligned(64))) Shard;
+
+// LRU Cache Structure (recency is kept per shard)
+
+typedef struct {
+    int capacity, shardCount;
+    EvictPolicy policy;
+    Shard *shards;
 } LRUCache;
 
-// Hash Function
+// Hash Function (murmur3 finalizer, so sequential keys spread out)
 
-int hash(int key) {
-    if (key < 0) key = -key;
-    return key % HASH_SIZE;
+unsigned int hash(int key) {
+    unsigned int h = (unsigned int)key;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
 }
 
-void mapInsert(LRUCache *cache, int key, Node *node) {
-    int h = hash(key);
-    Entry *entry = (Entry*)malloc(sizeof(Entry));
-    entry->key = key;
-    entry->node = node;
-    entry->next = cache->hashMap[h];
-    cache->hashMap[h] = entry;
+// Slots are stored field by field with release stores, since CLOCK hits
+// read the index without the lock (see get)
+void slotStore(Slot *slot, Slot v) {
+    __atomic_store_n(&slot->key, v.key, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->dist, v.dist, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->node, v.node, __ATOMIC_RELEASE);
 }
 
-Node* mapGet(LRUCache *cache, int key) {
-    int h = hash(key);
-    Entry *cur = cache->hashMap[h];
+// Place an entry, taking the slot of any entry closer to its home
+void slotPlace(Shard *shard, int key, Node *node) {
+    Slot cur = { node, key, 0 };
+    unsigned int i = hash(key) & shard->mask;
 
-    while (cur) {
-        if (cur->key == key)
-            return cur->node;
-        cur = cur->next;
+    while (shard->slots[i].node) {
+        if (shard->slots[i].dist < cur.dist) {
+            Slot t = shard->slots[i];
+            slotStore(&shard->slots[i], cur);
+            cur = t;
+        }
+        i = (i + 1) & shard->mask;
+        cur.dist++;
     }
-    return NULL;
+    slotStore(&shard->slots[i], cur);
 }
 
-void mapDelete(LRUCache *cache, int key) {
-    int h = hash(key);
-    Entry *cur = cache->hashMap[h];
-    Entry *prev = NULL;
+// Table size for 'entries': at most 3/4 full
+unsigned int tableSize(int entries) {
+    unsigned int n = 16;
+    while (n / 4 * 3 < (unsigned int)entries)
+        n *= 2;
+    return n;
+}
 
-    while (cur) {
-        if (cur->key == key) {
-            if (prev) prev->next = cur->next;
-            else cache->hashMap[h] = cur->next;
-            free(cur);
-            return;
-        }
-        prev = cur;
-        cur = cur->next;
+void mapResize(Shard *shard, int entries) {
+    Slot *old = shard->slots;
+    unsigned int oldCount = old ? shard->mask + 1 : 0;
+    unsigned int n = tableSize(entries);
+
+    shard->slots = (Slot*)calloc(n, sizeof(Slot));
+    shard->mask = n - 1;
+
+    for (unsigned int i = 0; i < oldCount; i++)
+        if (old[i].node)
+            slotPlace(shard, old[i].key, old[i].node);
+    free(old);
+}
+
+// shard->size already counts the new entry. Shards never hold more than
+// the capacity their table was sized for at createCache, so once a cache
+// is in use its tables never move under an optimistic reader.
+void mapInsert(Shard *shard, int key, Node *node) {
+    if ((unsigned int)shard->size > (shard->mask + 1) / 4 * 3)
+        mapResize(shard, shard->size);
+    slotPlace(shard, key, node);
+}
+
+// Slot index of 'key', or -1. A probe stops early at an entry closer to
+// its home than the key would be.
+long mapFind(Shard *shard, int key) {
+    unsigned int i = hash(key) & shard->mask;
+
+    for (unsigned int d = 0; shard->slots[i].node && shard->slots[i].dist >= d; d++) {
+        if (shard->slots[i].key == key)
+            return i;
+        i = (i + 1) & shard->mask;
+    }
+    return -1;
+}
+
+Node* mapGet(Shard *shard, int key) {
+    long i = mapFind(shard, key);
+    return i < 0 ? NULL : shard->slots[i].node;
+}
+
+// mapGet without the lock: a writer may be shifting entries, so the
+// answer only counts if the shard's seq did not move (see get), and the
+// probe is bounded in case it sees a torn table
+Node* mapGetOptimistic(Shard *shard, int key) {
+    unsigned int i = hash(key) & shard->mask;
+
+    for (unsigned int d = 0; d <= shard->mask; d++) {
+        Slot *slot = &shard->slots[i];
+        Node *node = __atomic_load_n(&slot->node, __ATOMIC_ACQUIRE);
+        if (!node || __atomic_load_n(&slot->dist, __ATOMIC_ACQUIRE) < d)
+            return NULL;
+        if (__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) == key)
+            return node;
+        i = (i + 1) & shard->mask;
     }
+    return NULL;
+}
+
+// Remove 'key', shifting the entries after it back a slot
+void mapDelete(Shard *shard, int key) {
+    long found = mapFind(shard, key);
+    if (found < 0) return;
+
+    unsigned int i = (unsigned int)found;
+    unsigned int j = (i + 1) & shard->mask;
+    while (shard->slots[j].node && shard->slots[j].dist > 0) {
+        Slot v = shard->slots[j];
+        v.dist--;
+        slotStore(&shard->slots[i], v);
+        i = j;
+        j = (j + 1) & shard->mask;
+    }
+    __atomic_store_n(&shard->slots[i].node, NULL, __ATOMIC_RELEASE);
 }
 
-void addToHead(LRUCache *cache, Node *node) {
+void addToHead(Shard *shard, Node *node) {
     node->prev = NULL;
-    node->next = cache->head;
+    node->next = shard->head;
 
-    if (cache->head)
-        cache->head->prev = node;
+    if (shard->head)
+        shard->head->prev = node;
 
-    cache->head = node;
+    shard->head = node;
 
-    if (cache->tail == NULL)
-        cache->tail = node;
+    if (shard->tail == NULL)
+        shard->tail = node;
 }
 
-void removeNode(LRUCache *cache, Node *node) {
+void removeNode(Shard *shard, Node *node) {
     if (node->prev)
         node->prev->next = node->next;
     else
-        cache->head = node->next;
+        shard->head = node->next;
 
     if (node->next)
         node->next->prev = node->prev;
     else
-        cache->tail = node->prev;
+        shard->tail = node->prev;
 }
 
-void moveToHead(LRUCache *cache, Node *node) {
-    removeNode(cache, node);
-    addToHead(cache, node);
+void moveToHead(Shard *shard, Node *node) {
+    removeNode(shard, node);
+    addToHead(shard, node);
 }
 
-Node* removeTail(LRUCache *cache) {
-    if (cache->tail == NULL) {
+Node* removeTail(Shard *shard) {
+    if (shard->tail == NULL) {
         printf("Error: Attempt to remove from an empty list.\n");
         return NULL;
     }
-    Node *temp = cache->tail;
-    removeNode(cache, temp);
+    Node *temp = shard->tail;
+    removeNode(shard, temp);
     return temp;
 }
 
-LRUCache* createCache(int capacity) {
-    if (capacity <= 0 || capacity > 1000) {
-        printf("Invalid capacity. Must be 1–1000.\n");
+// CLOCK: the first pool node from the hand on that has not been hit
+// since the last sweep, clearing reference bits on the way
+Node* clockVictim(Shard *shard) {
+    for (;;) {
+        Node *node = &shard->pool[shard->hand];
+        if (++shard->hand == shard->capacity)
+            shard->hand = 0;
+        if (!__atomic_load_n(&node->ref, __ATOMIC_RELAXED))
+            return node;
+        __atomic_store_n(&node->ref, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Values are copied a word at a time, for the same reason as slots
+void storeValue(Node *node, const char *value) {
+    uint64_t w[VALUE_WORDS] = { 0 };
+    strcpy((char*)w, value);
+    for (int i = 0; i < VALUE_WORDS; i++)
+        __atomic_store_n(&node->value[i], w[i], __ATOMIC_RELEASE);
+}
+
+void loadValue(Node *node, uint64_t *w) {
+    for (int i = 0; i < VALUE_WORDS; i++)
+        w[i] = __atomic_load_n(&node->value[i], __ATOMIC_ACQUIRE);
+}
+
+// A writer bumps the shard's seq to odd before it changes anything an
+// optimistic reader looks at, and back to even when done. Those changes
+// are release stores, so a reader that sees one of them (with an acquire
+// load) also sees the odd seq on its check afterwards.
+void writeBegin(Shard *shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+}
+
+void writeEnd(Shard *shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Record a hit; CLOCK callers may hold no lock at all
+void touchNode(LRUCache *cache, Shard *shard, Node *node) {
+    if (cache->policy == EVICT_LRU)
+        moveToHead(shard, node);
+    else if (!__atomic_load_n(&node->ref, __ATOMIC_RELAXED))
+        __atomic_store_n(&node->ref, 1, __ATOMIC_RELAXED);
+}
+
+LRUCache* createCache(int capacity, int shardCount, EvictPolicy policy) {
+    if (capacity <= 0 || capacity > MAX_CAPACITY) {
+        printf("Invalid capacity. Must be 1–%d.\n", MAX_CAPACITY);
         return NULL;
     }
+    if (shardCount < 1) shardCount = 1;
+    if (shardCount > capacity) shardCount = capacity;
 
     LRUCache *cache = (LRUCache*)malloc(sizeof(LRUCache));
     cache->capacity = capacity;
-    cache->size = 0;
-    cache->head = cache->tail = NULL;
+    cache->shardCount = shardCount;
+    cache->policy = policy;
+    cache->shards = (Shard*)aligned_alloc(64, sizeof(Shard) * shardCount);
+
+    for (int i = 0; i < shardCount; i++) {
+        Shard *shard = &cache->shards[i];
+        pthread_rwlock_init(&shard->lock, NULL);
+        shard->capacity = capacity / shardCount + (i < capacity % shardCount);
+        shard->seq = 0;
+        shard->size = 0;
+        shard->head = shard->tail = NULL;
+        shard->hand = 0;
+        shard->pool = (Node*)malloc(sizeof(Node) * shard->capacity);
+
+        // sized for a full shard
+        shard->slots = NULL;
+        mapResize(shard, shard->capacity);
+    }
+    return cache;
+}
 
-    for (int i = 0; i < HASH_SIZE; i++)
-        cache->hashMap[i] = NULL;
+void freeCache(LRUCache *cache) {
+    if (!cache) return;
+    for (int i = 0; i < cache->shardCount; i++) {
+        pthread_rwlock_destroy(&cache->shards[i].lock);
+        free(cache->shards[i].pool);
+        free(cache->shards[i].slots);
+    }
+    free(cache->shards);
+    free(cache);
+}
 
-    return cache;
+// The shard takes the high hash bits; the shard's table uses the low ones
+Shard* shardFor(LRUCache *cache, int key) {
+    unsigned long long h = hash(key);
+    return &cache->shards[(h * cache->shardCount) >> 32];
 }
 
-char* get(LRUCache *cache, int key) {
+// Copies the value into 'buf' (MAX_VALUE_LEN bytes), as the node may be
+// reused by another thread once the shard is unlocked.
+//
+// A CLOCK hit takes no lock: it reads the index and the value between
+// two loads of the shard's seq and retries if a put ran meanwhile. Only
+// after OPTIMISTIC_TRIES lost races does it wait on the lock.
+char* get(LRUCache *cache, int key, char *buf) {
     if (!cache) return NULL;
 
-    Node *node = mapGet(cache, key);
-    if (!node)
-        return NULL;
+    Shard *shard = shardFor(cache, key);
+    uint64_t w[VALUE_WORDS];
+
+    for (int tries = 0; cache->policy == EVICT_CLOCK && tries < OPTIMISTIC_TRIES; tries++) {
+        unsigned int seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        Node *node = mapGetOptimistic(shard, key);
+        if (node)
+            loadValue(node, w);
+        if (__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        if (!node)
+            return NULL;
+        touchNode(cache, shard, node);
+        strcpy(buf, (char*)w);
+        return buf;
+    }
+
+    if (cache->policy == EVICT_CLOCK)
+        pthread_rwlock_rdlock(&shard->lock);
+    else
+        pthread_rwlock_wrlock(&shard->lock);
+
+    Node *node = mapGet(shard, key);
+    if (node) {
+        touchNode(cache, shard, node);
+        loadValue(node, w);
+        strcpy(buf, (char*)w);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return node ? buf : NULL;
+}
+
+// put with the shard locked; returns -1 for a rejected duplicate
+int putLocked(LRUCache *cache, Shard *shard, int key, char *value) {
+    Node *node = mapGet(shard, key);
+
+    // Reject duplicate keys 
+    if (node && REJECT_DUPLICATES)
+        return -1;
+
+    writeBegin(shard);
+    if (node) {
+        storeValue(node, value);
+        touchNode(cache, shard, node);
+        writeEnd(shard);
+        return 0;
+    }
 
-    moveToHead(cache, node);
-    return node->value;
+    // Until the shard fills, take the next pool node; after that the
+    // evicted node (LRU tail or CLOCK victim) is reused for the new key
+    Node *newNode;
+    if (shard->size < shard->capacity) {
+        newNode = &shard->pool[shard->size++];
+    } else {
+        newNode = cache->policy == EVICT_LRU ? removeTail(shard) : clockVictim(shard);
+        mapDelete(shard, newNode->key);
+    }
+    newNode->key = key;
+    __atomic_store_n(&newNode->ref, 0, __ATOMIC_RELAXED);
+    storeValue(newNode, value);
+    newNode->prev = newNode->next = NULL;
+
+    if (cache->policy == EVICT_LRU)
+        addToHead(shard, newNode);
+    mapInsert(shard, key, newNode);
+    writeEnd(shard);
+    return 0;
 }
 
 void put(LRUCache *cache, int key, char *value) {
@@ -158,49 +412,159 @@ void put(LRUCache *cache, int key, char *value) {
         return;
     }
 
-    Node *node = mapGet(cache, key);
+    Shard *shard = shardFor(cache, key);
+    pthread_rwlock_wrlock(&shard->lock);
+    int r = putLocked(cache, shard, key, value);
+    pthread_rwlock_unlock(&shard->lock);
 
-    // Reject duplicate keys 
-    if (node && REJECT_DUPLICATES) {
+    if (r < 0)
         printf("Duplicate key not allowed.\n");
-        return;
+}
+
+// Benchmark: one cache shared by 1, 2, 4 ... benchThreads threads, each
+// doing benchOps random gets (benchReadPct percent) and puts over twice
+// as many keys as the cache holds; then the same with gets only, to show
+// how hits alone scale
+
+int benchThreads = 0;       // 0: one per online CPU
+int benchCapacity = 100000;
+int benchReadPct = 90;
+long benchOps = 2000000;
+
+typedef struct {
+    LRUCache *cache;
+    int readPct;
+    unsigned int seed;
+    pthread_barrier_t *start;
+} BenchThread;
+
+void* benchWorker(void *arg) {
+    BenchThread *t = (BenchThread*)arg;
+    char value[MAX_VALUE_LEN] = "value", buf[MAX_VALUE_LEN];
+    unsigned int x = t->seed, keys = 2u * benchCapacity;
+
+    pthread_barrier_wait(t->start);
+    for (long i = 0; i < benchOps; i++) {
+        x ^= x << 13;           // xorshift32
+        x ^= x >> 17;
+        x ^= x << 5;
+        if ((unsigned long long)x * 100 >> 32 < (unsigned int)t->readPct)   // uniform 0..99
+            get(t->cache, (int)(x % keys), buf);
+        else
+            put(t->cache, (int)(x % keys), value);
     }
+    return NULL;
+}
 
-    if (node) {
-        strcpy(node->value, value);
-        moveToHead(cache, node);
-        return;
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Operations per second with 'threads' threads on a warm cache
+double benchRun(int threads, int shardCount, EvictPolicy policy, int readPct) {
+    LRUCache *cache = createCache(benchCapacity, shardCount, policy);
+    char value[MAX_VALUE_LEN] = "value";
+    for (int k = 0; k < benchCapacity; k++)
+        put(cache, k, value);
+
+    pthread_t *tid = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    BenchThread *t = (BenchThread*)malloc(sizeof(BenchThread) * threads);
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads + 1);
+
+    for (int i = 0; i < threads; i++) {
+        t[i].cache = cache;
+        t[i].readPct = readPct;
+        t[i].seed = 2463534242u + 7919u * i;
+        t[i].start = &start;
+        pthread_create(&tid[i], NULL, benchWorker, &t[i]);
     }
+    pthread_barrier_wait(&start);
+    double t0 = now();
+    for (int i = 0; i < threads; i++)
+        pthread_join(tid[i], NULL);
+    double elapsed = now() - t0;
+
+    pthread_barrier_destroy(&start);
+    free(tid);
+    free(t);
+    freeCache(cache);
+    return (double)benchOps * threads / elapsed;
+}
 
-    Node *newNode = (Node*)malloc(sizeof(Node));
-    newNode->key = key;
-    strcpy(newNode->value, value);
-    newNode->prev = newNode->next = NULL;
+void benchTable(int maxThreads, int shardCount, EvictPolicy policy, int readPct) {
+    printf("%s, capacity %d, %d shards, %d%% gets, %ld ops per thread\n",
+           policy == EVICT_CLOCK ? "CLOCK" : "LRU", benchCapacity, shardCount, readPct, benchOps);
+    printf("%8s %12s %8s\n", "threads", "Mops/s", "speedup");
+
+    double base = 0;
+    for (int n = 1; ; n = n * 2 < maxThreads ? n * 2 : maxThreads) {
+        double rate = benchRun(n, shardCount, policy, readPct);
+        if (n == 1) base = rate;
+        printf("%8d %12.2f %7.2fx\n", n, rate / 1e6, rate / base);
+        if (n == maxThreads) break;
+    }
+}
 
-    addToHead(cache, newNode);
-    mapInsert(cache, key, newNode);
-    cache->size++;
+void runBench(int shardCount, EvictPolicy policy) {
+    int maxThreads = benchThreads > 0 ? benchThreads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (maxThreads < 1) maxThreads = 1;
 
-    if (cache->size > cache->capacity) {
-        Node *lru = removeTail(cache);
-        if (lru) {
-            mapDelete(cache, lru->key);
-            free(lru);
-            cache->size--;
-        }
+    benchTable(maxThreads, shardCount, policy, benchReadPct);
+    if (benchReadPct != 100) {
+        printf("\n");
+        benchTable(maxThreads, shardCount, policy, 100);
     }
 }
 
-int main() {
+int main(int argc, char **argv) {
     char command[50];
     LRUCache *cache = NULL;
+    int shardCount = 0, bench = 0;
+    EvictPolicy policy = EVICT_LRU;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            shardCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--clock") == 0) {
+            policy = EVICT_CLOCK;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            benchThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--capacity") == 0 && i + 1 < argc) {
+            benchCapacity = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            benchOps = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--reads") == 0 && i + 1 < argc) {
+            benchReadPct = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--shards N] [--clock] [--bench [--threads N] [--capacity N] [--ops N] [--reads PCT]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (bench) {
+        if (benchCapacity <= 0 || benchCapacity > MAX_CAPACITY || benchOps <= 0 ||
+            benchReadPct < 0 || benchReadPct > 100) {
+            fprintf(stderr, "Invalid benchmark settings.\n");
+            return 1;
+        }
+        // 64 shards unless told otherwise; the interactive cache defaults
+        // to one, which keeps exact LRU order
+        runBench(shardCount > 0 ? shardCount : 64, policy);
+        return 0;
+    }
 
     while (scanf("%s", command) != EOF) {
 
         if (strcmp(command, "createCache") == 0) {
             int cap;
             scanf("%d", &cap);
-            cache = createCache(cap);
+            freeCache(cache);
+            cache = createCache(cap, shardCount, policy);
         }
 
         else if (strcmp(command, "put") == 0) {
@@ -212,8 +576,9 @@ int main() {
 
         else if (strcmp(command, "get") == 0) {
             int key;
+            char buf[MAX_VALUE_LEN];
             scanf("%d", &key);
-            char *val = get(cache, key);
+            char *val = get(cache, key, buf);
             printf("%s\n", val ? val : "NULL");
         }
 